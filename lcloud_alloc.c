@@ -0,0 +1,129 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_alloc.c
+//  Description    : This is the implementation of the free space bitmaps
+//                   used by the LionCloud filesystem to allocate device
+//                   blocks, one bit per block searched a word at a time
+//                   from a next fit cursor.
+//
+//   Author        : Samuel Johnson
+//   Last Modified : 10/16/2026
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <cmpsc311_log.h>
+
+// Project includes
+#include <lcloud_alloc.h>
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_alloc_init
+// Description  : Set up an empty map, the bits past the last block are set
+//                so a search never hands them out
+//
+// Inputs       : map - the map
+//                nblocks - number of blocks it covers
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_alloc_init( LcAllocMap *map, int nblocks ) {
+
+    map->words = (nblocks + 63)/64;
+    map->nblocks = nblocks;
+    map->freeBlocks = nblocks;
+    map->cursor = 0;
+    if((map->bits = calloc((map->words > 0) ? map->words : 1, sizeof(uint64_t))) == NULL){
+        logMessage( LOG_ERROR_LEVEL, "Unable to allocate a free space map of [%d] blocks.", nblocks);
+        return( -1 );
+    }
+    if(nblocks % 64){
+        map->bits[map->words - 1] = ~(uint64_t)0 << (nblocks % 64);
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_alloc_close
+// Description  : Release a map
+//
+// Inputs       : map - the map
+// Outputs      : none
+
+void lcloud_alloc_close( LcAllocMap *map ) {
+    free(map->bits);
+    memset(map, 0, sizeof(LcAllocMap));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_alloc_take
+// Description  : Allocate the first free block at or after the cursor,
+//                wrapping around, skipping full words 64 blocks at a time
+//
+// Inputs       : map - the map
+// Outputs      : the block, -1 if the map is full
+
+int lcloud_alloc_take( LcAllocMap *map ) {
+
+    uint64_t word;
+    int w, bit;
+
+    if(map->freeBlocks == 0){
+        return( -1 );
+    }
+
+    for(int n = 0; n < map->words; n++){
+        w = (map->cursor + n) % map->words;
+        if((word = map->bits[w]) != ~(uint64_t)0){
+            bit = __builtin_ctzll(~word); // First zero bit of the word
+            map->bits[w] = word | ((uint64_t)1 << bit);
+            map->freeBlocks --;
+            map->cursor = w; // Allocation carries on from here
+            return( w*64 + bit );
+        }
+    }
+    return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_alloc_free
+// Description  : Give a block back
+//
+// Inputs       : map - the map
+//                blk - the block
+// Outputs      : 0 if successful, -1 if the block is out of range or free
+
+int lcloud_alloc_free( LcAllocMap *map, int blk ) {
+
+    uint64_t mask = (uint64_t)1 << (blk % 64);
+
+    if(blk < 0 || blk >= map->nblocks || !(map->bits[blk/64] & mask)){
+        return( -1 );
+    }
+    map->bits[blk/64] &= ~mask;
+    map->freeBlocks ++;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_alloc_used
+// Description  : Check if a block is in use
+//
+// Inputs       : map - the map
+//                blk - the block
+// Outputs      : 1 if the block is in use, 0 if it is free (or out of range)
+
+int lcloud_alloc_used( LcAllocMap *map, int blk ) {
+    if(blk < 0 || blk >= map->nblocks){
+        return( 0 );
+    }
+    return( (map->bits[blk/64] >> (blk % 64)) & 1 );
+}
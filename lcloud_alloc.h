@@ -0,0 +1,44 @@
+#ifndef LCLOUD_ALLOC_INCLUDED
+#define LCLOUD_ALLOC_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_alloc.h
+//  Description    : This is the interface of the free space bitmaps used by
+//                   the LionCloud filesystem to allocate device blocks.
+//
+//   Author        : Samuel Johnson
+//   Last Modified : 10/16/2026
+//
+
+// Includes
+#include <stdint.h>
+
+// Type definitions
+typedef struct LcAllocMap {
+    uint64_t *bits; // One bit per block, set while the block is in use
+    int words; // Number of 64 bit words in bits
+    int nblocks; // Number of blocks the map covers
+    int freeBlocks; // Number of blocks not in use
+    int cursor; // Word the next search starts at (next fit)
+} LcAllocMap;
+
+//
+// Functional Prototypes
+
+int lcloud_alloc_init( LcAllocMap *map, int nblocks );
+    // Set up an empty map of nblocks blocks
+
+void lcloud_alloc_close( LcAllocMap *map );
+    // Release a map
+
+int lcloud_alloc_take( LcAllocMap *map );
+    // Allocate the next free block at or after the cursor
+
+int lcloud_alloc_free( LcAllocMap *map, int blk );
+    // Give a block back
+
+int lcloud_alloc_used( LcAllocMap *map, int blk );
+    // Check if a block is in use
+
+#endif
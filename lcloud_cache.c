@@ -4,212 +4,1997 @@
 //  Description    : This is the cache implementation for the LionCloud
 //                   assignment for CMPSC311.
 //
+//                   The cache is split into shards by the hash of the
+//                   (device, sector, block) key.  Each shard has its own
+//                   lock, index, replacement policy, dirty list and
+//                   statistics, so threads touching different shards never
+//                   wait on each other.
+//
+//                   In write-back mode a flusher thread writes dirty blocks
+//                   back in batches, outside the shard locks, once a shard
+//                   passes its high watermark or a block has been dirty for
+//                   too long.
+//
 //   Author        : Patrick McDaniel
 //   Last Modified : Thu 19 Mar 2020 09:27:55 AM EDT
 //
 
-// Includes 
+// Includes
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <cmpsc311_log.h>
 #include <lcloud_cache.h>
 
+// Defines
+#define LC_CACHE_NONE -1 // Null index used by the hash chains and the free list
+#define LC_CACHE_MAXSHARDS 64 // Most shards the cache is split into
+#define LC_CACHE_SHARDBLOCKS 256 // Fewest blocks per shard when picking the shard count
+#define LC_CACHE_HUGEPAGE (2*1024*1024) // Size of a huge page, the arena is rounded up to it
+#define LC_CACHE_LINE 64 // Size of a CPU cache line
+#define LC_CACHE_MRC_KEYS 4096 // Most sampled keys the trackers remember, split over the shards
+#define LC_CACHE_MRC_MINKEYS 256 // Fewest sampled keys a shard's tracker remembers
+#define LC_CACHE_MRC_SPAN 4 // Times a tracker's clock covers, in multiples of its keys
+#define LC_CACHE_MRC_SPACE (1<<24) // Size of the hash space keys are sampled from
+#define LC_CACHE_SNAPSHOT_MAGIC "LCSNAP01" // First bytes of a cache snapshot file
+#define LC_CACHE_SNAPSHOT_DATA 1 // Snapshot flag, the data of each block follows its key
 
+// SHARDS style miss ratio curve tracker, one per shard: an LRU stack of a
+// hash sampled subset of the shard's keys, whose stack distances (scaled up by
+// the sampling rate and the shard count) estimate the hit ratio of an LRU
+// cache of any size. Each key's last reference time is marked in a Fenwick
+// tree, so a distance is the count of marks after it rather than a stack walk.
+typedef struct cacheMrc {
+    int keysMax; // Most sampled keys remembered, 0 if the tracker is off
+    uint64_t *keys; // Sampled keys, by slot
+    int *prev; // Stack links, by slot (head is most recent)
+    int *next;
+    int *hashNext; // Hash chains (or the free list), by slot
+    int *index; // Hash buckets
+    int indexMask; // Number of hash buckets minus one
+    int head, tail, freeList;
+    int *stamp; // Time of the last reference, by slot
+    int *tree; // Fenwick tree over times 1 to span, 1 at each slot's stamp
+    int span; // Last time before the stack is renumbered
+    int now; // Time of the latest reference
+    long *hist; // hist[d] counts references at sampled stack distance d
+    long samples; // Sampled references
+} cacheMrc;
+
+// Metadata of a cache block, the data itself lives in the shard's part of the arena
 typedef struct cacheBlock {
     int device; // device number of the cache block
     int sector; // sector number mof the cache block
     int block; // block number of the cache block
-    char data[256]; // Array containing the data of the cache
-    int time; // Time which the cache block was recently used
+    int hashNext; // Next block in the same hash bucket (or in the free list)
+    int dirty; // 1 if the block was written but not yet flushed to the device
+    long dirtyTime; // Time (in ms) the block became dirty
+    int dirtyPrev; // Next older dirty block
+    int dirtyNext; // Next newer dirty block
+    int pins; // Number of readers using the data, the block is not evicted while pinned
+    int flushing; // 1 while a copy of the block is being written back outside the shard lock
+    unsigned gen; // Bumped whenever the data changes, tells if it changed during a writeback
+    int verified; // 0 while the data is a snapshot copy no device read or write has confirmed
 } cacheBlock;
 
-cacheBlock *cache;
+typedef struct cacheShard {
+    pthread_mutex_t lock; // Protects everything in the shard
+    pthread_cond_t flushed; // Signalled when writebacks done outside the lock finish
+    cacheBlock *blocks; // The blocks of the shard
+    char *data; // Data of the blocks, block i starts at data + i*LC_DEVICE_BLOCK_SIZE
+    int size; // Number of blocks in the shard
+    int *index; // Hash buckets, each holding the index of the first block in its chain
+    int indexMask; // Number of hash buckets minus one (bucket count is a power of 2)
+    int freeList; // Head of the list of unused cache blocks
+    cachePolicy pol; // Replacement policy deciding which block to evict
+    cacheMrc mrc; // Miss ratio curve tracker of the shard
+    int dirtyOldest; // Oldest dirty block
+    int dirtyNewest; // Newest dirty block
+    int dirtyCount; // Number of dirty blocks
+    int flushingCount; // Number of blocks being written back outside the lock
+    long hits; // Number of cache hits
+    long misses; // Number of cache misses
+    long evictions; // Number of blocks evicted
+    long writebacks; // Number of dirty blocks written back
+    long devHits[LC_CACHE_MAXDEVICES]; // Cache hits by device
+    long devMisses[LC_CACHE_MAXDEVICES]; // Cache misses by device
+} cacheShard;
+
 
-int cacheHits; // Number of cache hits
-int cacheMisses; // Number of cache misses
+cacheShard *cache; // The shards of the cache
+int cacheShards; // Number of shards (a power of 2)
 int cacheSize; // Size of the cache
+char *cacheArena; // Contiguous data of every block in the cache
+size_t cacheArenaSize; // Size of the arena in bytes
+int cacheArenaHuge; // 1 if the arena is backed by huge pages
+int mrcRate; // One key in mrcRate is sampled by the trackers, 0 if they are off
+uint32_t mrcThreshold; // Keys hashing below this are sampled
 
-int cacheAccess; // Count to keep track of the time accessed
+LcCacheWriter cacheWriter; // Function used to write dirty blocks to the devices
+LcCacheBatchWriter cacheBatchWriter; // Function used to write batches of dirty blocks, NULL to write them one at a time
+char *snapshotPath; // File the cache is saved to on close and loaded from on init, NULL if off
+int snapshotData; // 1 if the snapshot holds block data as well as keys
+uint64_t *warmKeys; // Keys loaded from a snapshot that still have to be read from the devices
+int warmCount; // Number of keys in warmKeys
+int writeBack; // 1 if writes stay in the cache until flushed
+int dirtyHigh; // Percent of a shard that may be dirty before flushing starts
+int dirtyLow; // Percent of a shard left dirty once a flush finishes
+int dirtyMaxAge; // Longest time (in ms) a block may stay dirty
+
+pthread_t flusher; // Thread writing dirty blocks back in the background
+int flusherRunning; // 1 if the flusher thread was started
+int flusherStop; // Set to ask the flusher to exit
+pthread_mutex_t flusherLock = PTHREAD_MUTEX_INITIALIZER; // Protects flusherStop (taken after a shard lock)
+pthread_cond_t flusherWake = PTHREAD_COND_INITIALIZER; // Wakes the flusher early, when a shard passes its high watermark
+
+// A dirty block taken for writeback, its data copied out so the shard can be unlocked
+typedef struct cacheFlush {
+    cacheShard *sh; // The shard of the block
+    int i; // Index of the block in the shard
+    unsigned gen; // Generation of the data that was copied
+} cacheFlush;
 
 //
 // Functions
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcloud_getcache
-// Description  : Search the cache for a block 
+// Function     : cache_data
+// Description  : Find the data of a cache block in the arena
 //
-// Inputs       : did - device number of block to find
-//                sec - sector number of block to find
-//                blk - block number of block to find
-// Outputs      : cache block if found (pointer), NULL if not or failure
+// Inputs       : sh - the shard of the block
+//                i - index of the block in the shard
+// Outputs      : pointer to the 256 bytes of the block
 
-char * lcloud_getcache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+static char * cache_data( cacheShard *sh, int i ) {
+    return( sh->data + (size_t)i*LC_DEVICE_BLOCK_SIZE );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_arena
+// Description  : Allocate the data arena, using huge pages when the system
+//                has them and falling back to normal pages if not
+//
+// Inputs       : bytes - the size of the arena
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_arena( size_t bytes ) {
+    void *arena;
+
+    cacheArenaSize = (bytes + LC_CACHE_HUGEPAGE - 1) & ~((size_t)LC_CACHE_HUGEPAGE - 1);
+    cacheArenaHuge = 1;
+    arena = mmap(NULL, cacheArenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if(arena == MAP_FAILED){
+        // No reserved huge pages, use normal (page aligned) memory and ask for transparent huge pages
+        cacheArenaSize = bytes;
+        cacheArenaHuge = 0;
+        arena = mmap(NULL, cacheArenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(arena == MAP_FAILED){
+            logMessage( LOG_ERROR_LEVEL, "Unable to map cache arena of [%zu] bytes.", bytes);
+            return( -1 );
+        }
+#ifdef MADV_HUGEPAGE
+        if(cacheArenaSize >= LC_CACHE_HUGEPAGE){
+            madvise(arena, cacheArenaSize, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    cacheArena = arena;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_hash
+// Description  : Hash a (device, sector, block) key, the top bits pick the
+//                shard and the bottom bits the bucket within it
+//
+// Inputs       : did - device number of block
+//                sec - sector number of block
+//                blk - block number of block
+// Outputs      : the hash
+
+static uint32_t cache_hash( int did, int sec, int blk ) {
+    uint32_t key = ((uint32_t)did << 24) ^ ((uint32_t)sec << 12) ^ (uint32_t)blk;
 
-    for(int i = 0; i < cacheSize; i++){
+    // Mix the bits so neighbouring blocks spread over the table
+    key ^= key >> 16;
+    key *= 0x45d9f3b;
+    key ^= key >> 16;
+    key *= 0x45d9f3b;
+    key ^= key >> 16;
+    return( key );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_shard
+// Description  : Find the shard holding a key
+//
+// Inputs       : did - device number of block
+//                sec - sector number of block
+//                blk - block number of block
+// Outputs      : the shard
 
-        if(cache[i].device == did && cache[i].block == blk && cache[i].sector == sec){ // Check if it is a cache hit
+static cacheShard * cache_shard( int did, int sec, int blk ) {
+    return( &cache[(cache_hash(did, sec, blk) >> 24) & (cacheShards - 1)] );
+}
 
-            cache[i].time = cacheAccess; // Update the time of the accessed cache block
-            cacheAccess ++; // Increment the cache access time
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_find
+// Description  : Look up the cache block holding a key
+//
+// Inputs       : sh - the shard of the key
+//                did - device number of block
+//                sec - sector number of block
+//                blk - block number of block
+// Outputs      : index of the block in the shard, LC_CACHE_NONE if not there
 
-            cacheHits ++; // Update the cache hits value
+static int cache_find( cacheShard *sh, int did, int sec, int blk ) {
+    int i = sh->index[cache_hash(did, sec, blk) & sh->indexMask];
 
-            return cache[i].data; // Returns the pointer to the cache data
+    while(i != LC_CACHE_NONE){
+        if(sh->blocks[i].device == did && sh->blocks[i].block == blk && sh->blocks[i].sector == sec){
+            return( i );
         }
+        i = sh->blocks[i].hashNext;
+    }
+    return( LC_CACHE_NONE );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_findverified
+// Description  : Look up the cache block holding a key, skipping snapshot
+//                data the devices have not confirmed yet
+//
+// Inputs       : sh - the shard of the key
+//                did - device number of block
+//                sec - sector number of block
+//                blk - block number of block
+// Outputs      : index of the block in the shard, LC_CACHE_NONE if not there
+
+static int cache_findverified( cacheShard *sh, int did, int sec, int blk ) {
+    int i = cache_find(sh, did, sec, blk);
 
+    return( (i != LC_CACHE_NONE && sh->blocks[i].verified) ? i : LC_CACHE_NONE );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_unindex
+// Description  : Remove a block from its hash chain
+//
+// Inputs       : sh - the shard of the block
+//                i - index of the block in the shard
+// Outputs      : none
+
+static void cache_unindex( cacheShard *sh, int i ) {
+    cacheBlock *b = &sh->blocks[i];
+    int *link = &sh->index[cache_hash(b->device, b->sector, b->block) & sh->indexMask];
+
+    while(*link != i){
+        link = &sh->blocks[*link].hashNext;
     }
+    *link = b->hashNext;
+}
 
-    cacheMisses ++; // Increment the cache misses counter
-    /* Return not found */
-    return( NULL );
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_key
+// Description  : Pack a (device, sector, block) location into one key
+//
+// Inputs       : did - device number of block
+//                sec - sector number of block
+//                blk - block number of block
+// Outputs      : the key
+
+static uint64_t cache_key( int did, int sec, int blk ) {
+    return( ((uint64_t)did << 32) | ((uint64_t)(sec & 0xffff) << 16) | (uint64_t)(blk & 0xffff) );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcloud_putcache
-// Description  : Put a value in the cache 
+// Function     : mrc_add
+// Description  : Add to one time of the tracker's Fenwick tree
 //
-// Inputs       : did - device number of block to insert
-//                sec - sector number of block to insert
-//                blk - block number of block to insert
-// Outputs      : 0 if succesfully inserted, -1 if failure
+// Inputs       : m - the tracker
+//                t - the time (1 to m->span)
+//                v - the amount to add
+// Outputs      : none
 
-int lcloud_putcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+static void mrc_add( cacheMrc *m, int t, int v ) {
+    for(; t <= m->span; t += t & -t){
+        m->tree[t] += v;
+    }
+}
 
-    cacheBlock newBlock; // Block used to put into the cache
-    int oldest = cacheAccess; // Keeps track of the oldest cache access it finds
-    int oldestIndex; // Keeps track of index of the oldest cache
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mrc_sum
+// Description  : Count the keys of the tracker last referenced at or before a time
+//
+// Inputs       : m - the tracker
+//                t - the time
+// Outputs      : the count
 
-    // Runs if the cache is full
-    if(cacheAccess >= cacheSize - 1){
+static int mrc_sum( cacheMrc *m, int t ) {
+    int sum = 0;
 
-        // Iterates through the cache to find the oldest access
-        for(int i = 0; i < cacheSize; i++){
+    for(; t > 0; t -= t & -t){
+        sum += m->tree[t];
+    }
+    return( sum );
+}
 
-            if(cache[i].device == did && cache[i].block == blk && cache[i].sector == sec){ // Check if it is a cache hit
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mrc_renumber
+// Description  : Give the keys of the stack the times 1 to count, oldest
+//                first, once the clock has reached the end of the tree
+//
+// Inputs       : m - the tracker
+// Outputs      : none
 
-                // Update the cache data
-                memcpy(cache[i].data, block, 256);
-                cache[i].time = cacheAccess; // Saves the time the cache was accessed
-                cacheAccess ++; // Increment the cache access counter
-                return(0);
+static void mrc_renumber( cacheMrc *m ) {
+    memset(m->tree, 0, (m->span+1)*sizeof(int));
+    m->now = 0;
+    for(int j = m->tail; j != LC_CACHE_NONE; j = m->prev[j]){
+        m->stamp[j] = ++m->now;
+        mrc_add(m, m->now, 1);
+    }
+}
 
-            }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_mrc
+// Description  : Feed a reference to the shard's miss ratio curve tracker,
+//                which only looks at the keys that hash into its sample
+//
+// Inputs       : sh - the shard of the key (locked)
+//                key - the key referenced
+//                count - 1 to count the reference (a lookup), 0 to only
+//                        move the key to the top of the stack (an insert)
+// Outputs      : none
 
-            if(cache[i].time < oldest){
-                oldest = cache[i].time; // Updates the oldest known access time
-                oldestIndex = i; // Saves the index of this value to be the oldest
-            }
+static void cache_mrc( cacheShard *sh, uint64_t key, int count ) {
+    cacheMrc *m = &sh->mrc;
+    uint32_t h = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 40); // 24 bits
+    int b, i;
 
-        }
+    if(m->keys == NULL || h >= mrcThreshold){
+        return;
+    }
 
-        // Populate the newBlock with the info to be put into the cache
-        newBlock.block = blk;
-        newBlock.sector = sec;
-        newBlock.device = did;
+    b = (h * 0x45d9f3b) & m->indexMask;
+    for(i = m->index[b]; i != LC_CACHE_NONE && m->keys[i] != key; i = m->hashNext[i]);
 
-        memcpy(newBlock.data, block, 256); // Copies over the passed data into the cache
+    if(i != LC_CACHE_NONE){
+        // The stack distance is the number of sampled keys used since this one
+        if(count){
+            m->hist[mrc_sum(m, m->now) - mrc_sum(m, m->stamp[i])] ++;
+        }
+        mrc_add(m, m->stamp[i], -1);
 
-        newBlock.time = cacheAccess; // Saves the time the cache was accessed
-        cacheAccess ++; // Increment the cache access counter
+        // Unlink it from the stack
+        if(m->prev[i] != LC_CACHE_NONE){
+            m->next[m->prev[i]] = m->next[i];
+        } else {
+            m->head = m->next[i];
+        }
+        if(m->next[i] != LC_CACHE_NONE){
+            m->prev[m->next[i]] = m->prev[i];
+        } else {
+            m->tail = m->prev[i];
+        }
+    } else {
+        // A cold miss (or one beyond what is tracked), take a free slot or the bottom of the stack
+        if(m->freeList != LC_CACHE_NONE){
+            i = m->freeList;
+            m->freeList = m->hashNext[i];
+        } else {
+            uint32_t ob;
+            int *link;
 
-        cache[oldestIndex] = newBlock; // Adds the newBlock to the cache
-        cacheMisses++; // Count this as a cache miss
+            i = m->tail;
+            m->tail = m->prev[i];
+            m->next[m->tail] = LC_CACHE_NONE;
+            mrc_add(m, m->stamp[i], -1);
 
-        return ( 0 ); // Returns a 0 for success
+            ob = ((uint32_t)((m->keys[i] * 0x9E3779B97F4A7C15ULL) >> 40) * 0x45d9f3b) & m->indexMask;
+            for(link = &m->index[ob]; *link != i; link = &m->hashNext[*link]);
+            *link = m->hashNext[i];
+        }
+        m->keys[i] = key;
+        m->hashNext[i] = m->index[b];
+        m->index[b] = i;
+    }
 
+    // Push it on top of the stack with the next time
+    if(m->now == m->span){
+        mrc_renumber(m);
+    }
+    m->prev[i] = LC_CACHE_NONE;
+    m->next[i] = m->head;
+    if(m->head != LC_CACHE_NONE){
+        m->prev[m->head] = i;
+    } else {
+        m->tail = i;
+    }
+    m->head = i;
+    m->stamp[i] = ++m->now;
+    mrc_add(m, m->now, 1);
 
+    if(count){
+        m->samples ++;
+    }
+}
 
-    } else { // Runs if the cache is not full
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_mrcclose
+// Description  : Release the miss ratio curve trackers of every shard
+//
+// Inputs       : none
+// Outputs      : none
 
-        for(int i = 0; i < cacheSize; i++){
+static void cache_mrcclose( void ) {
+    for(int s = 0; s < cacheShards; s++){
+        cacheMrc *m = &cache[s].mrc;
 
-            if(cache[i].device == did && cache[i].block == blk && cache[i].sector == sec){ // Check if it is a cache hit
+        free(m->keys);
+        free(m->prev);
+        free(m->next);
+        free(m->hashNext);
+        free(m->index);
+        free(m->stamp);
+        free(m->tree);
+        free(m->hist);
+        memset(m, 0, sizeof(cacheMrc));
+    }
+    mrcRate = 0;
+}
 
-                // Update the cache data
-                memcpy(cache[i].data, block, 256);
-                cache[i].time = cacheAccess; // Saves the time the cache was accessed
-                cacheAccess ++; // Increment the cache access counter
-                return(0);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_mrcinit
+// Description  : Set up a miss ratio curve tracker in every shard
+//
+// Inputs       : rate - one key in rate is sampled, 0 turns the trackers off
+// Outputs      : 0 if successful, -1 if failure
 
-            }
+static int cache_mrcinit( int rate ) {
+    int keys = LC_CACHE_MRC_KEYS/cacheShards;
+    int buckets = 1;
 
-            if(cache[i].block == -1){ // Checks if that cache block is empty
+    cache_mrcclose();
+    if(rate <= 0){
+        return( 0 );
+    }
 
-                // Populate the newBlock with the info to be put into the cache
-                newBlock.block = blk;
-                newBlock.sector = sec;
-                newBlock.device = did;
+    if(keys < LC_CACHE_MRC_MINKEYS){
+        keys = LC_CACHE_MRC_MINKEYS;
+    }
+    while(buckets < 2*keys){
+        buckets <<= 1;
+    }
+    for(int s = 0; s < cacheShards; s++){
+        cacheMrc *m = &cache[s].mrc;
 
-                memcpy(newBlock.data, block, 256); // Copies over the passed data into the cache
+        // Lock the shard, lookups may already be running
+        pthread_mutex_lock(&cache[s].lock);
+        m->span = LC_CACHE_MRC_SPAN*keys;
+        m->keys = malloc(keys*sizeof(uint64_t));
+        m->prev = malloc(keys*sizeof(int));
+        m->next = malloc(keys*sizeof(int));
+        m->hashNext = malloc(keys*sizeof(int));
+        m->index = malloc(buckets*sizeof(int));
+        m->stamp = malloc(keys*sizeof(int));
+        m->tree = calloc(m->span+1, sizeof(int));
+        m->hist = calloc(keys, sizeof(long));
+        if(m->keys == NULL || m->prev == NULL || m->next == NULL || m->hashNext == NULL ||
+            m->index == NULL || m->stamp == NULL || m->tree == NULL || m->hist == NULL){
+            pthread_mutex_unlock(&cache[s].lock);
+            logMessage( LOG_ERROR_LEVEL, "Unable to allocate the miss ratio curve tracker.");
+            return( -1 );
+        }
 
-                newBlock.time = cacheAccess; // Saves the time the cache was accessed
-                cacheAccess ++; // Increment the cache access counter
-                cacheMisses ++; //Count this as a cache miss
+        for(int i = 0; i < keys; i++){
+            m->hashNext[i] = (i+1 < keys) ? i+1 : LC_CACHE_NONE;
+        }
+        for(int i = 0; i < buckets; i++){
+            m->index[i] = LC_CACHE_NONE;
+        }
+        m->keysMax = keys;
+        m->indexMask = buckets - 1;
+        m->head = LC_CACHE_NONE;
+        m->tail = LC_CACHE_NONE;
+        m->freeList = 0;
+        pthread_mutex_unlock(&cache[s].lock);
+    }
+    mrcRate = rate;
+    mrcThreshold = LC_CACHE_MRC_SPACE/rate;
+    return( 0 );
+}
 
-                cache[i] = newBlock; // Adds the newBlock to the cache
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_count
+// Description  : Count a lookup as a hit or a miss, overall and by device
+//
+// Inputs       : sh - the shard of the block
+//                did - device number of the block
+//                hit - 1 for a hit, 0 for a miss
+// Outputs      : none
 
-                return 0; // Returns a 0 to indicate a successful placement
-            }
+static void cache_count( cacheShard *sh, int did, int hit ) {
+    if(hit){
+        sh->hits ++;
+        if(did < LC_CACHE_MAXDEVICES){
+            sh->devHits[did] ++;
+        }
+    } else {
+        sh->misses ++;
+        if(did < LC_CACHE_MAXDEVICES){
+            sh->devMisses[did] ++;
         }
     }
-    
-    /* Return a -1 if we get here somehow */
-    return( -1 );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcloud_initcache
-// Description  : Initialze the cache by setting up metadata a cache elements.
+// Function     : cache_now
+// Description  : Read the monotonic clock
 //
-// Inputs       : maxblocks - the max number number of blocks 
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : none
+// Outputs      : the time in ms
 
-int lcloud_initcache( int maxblocks ) {
-    cacheAccess = 0; // Set the initial value of cacheAccess to 0
+static long cache_now( void ) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return( ts.tv_sec*1000L + ts.tv_nsec/1000000L );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_dirty
+// Description  : Mark a block dirty, making it the newest dirty block
+//
+// Inputs       : sh - the shard of the block
+//                i - index of the block in the shard
+// Outputs      : none
 
-    // Block used to set the values of 
-    cacheBlock newBlock;
-    newBlock.device = -1;
-    newBlock.sector = -1;
-    newBlock.block = -1;
-    newBlock.time = -1;
+static void cache_dirty( cacheShard *sh, int i ) {
+    cacheBlock *b = &sh->blocks[i];
 
-    cache = realloc(cache, maxblocks*sizeof(cacheBlock)); // Allocate memory for the cache based on the maxblocks value
+    if(b->dirty){
+        return; // Keep the time of the first unflushed write
+    }
 
-    // Initialize all of cache blocks to have a location of -1,-1,-1
-    for(int i = 0; i < maxblocks; i++){   
-        cache[i] = newBlock;
+    b->dirty = 1;
+    b->dirtyTime = cache_now();
+    b->dirtyNext = LC_CACHE_NONE;
+    b->dirtyPrev = sh->dirtyNewest;
+    if(sh->dirtyNewest != LC_CACHE_NONE){
+        sh->blocks[sh->dirtyNewest].dirtyNext = i;
+    } else {
+        sh->dirtyOldest = i;
     }
+    sh->dirtyNewest = i;
+    sh->dirtyCount ++;
+}
 
-    cacheHits = 0; // Set the initial value of hits to 0
-    cacheMisses = 0; // Set the initial value of misses to 0
-    cacheSize = maxblocks;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_undirty
+// Description  : Mark a block clean without writing it
+//
+// Inputs       : sh - the shard of the block
+//                i - index of the block in the shard
+// Outputs      : none
 
-    /* Return successfully */
+static void cache_undirty( cacheShard *sh, int i ) {
+    cacheBlock *b = &sh->blocks[i];
+
+    if(!b->dirty){
+        return;
+    }
+
+    if(b->dirtyPrev != LC_CACHE_NONE){
+        sh->blocks[b->dirtyPrev].dirtyNext = b->dirtyNext;
+    } else {
+        sh->dirtyOldest = b->dirtyNext;
+    }
+    if(b->dirtyNext != LC_CACHE_NONE){
+        sh->blocks[b->dirtyNext].dirtyPrev = b->dirtyPrev;
+    } else {
+        sh->dirtyNewest = b->dirtyPrev;
+    }
+    b->dirty = 0;
+    sh->dirtyCount --;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_clean
+// Description  : Write a dirty block back to its device, waiting first for
+//                a writeback of it already under way
+//
+// Inputs       : sh - the shard of the block, locked by the caller
+//                i - index of the block in the shard
+// Outputs      : 0 if successful (or already clean), -1 if failure
+
+static int cache_clean( cacheShard *sh, int i ) {
+    cacheBlock *b = &sh->blocks[i];
+
+    // A block being flushed is neither evicted nor dropped, so it stays at i
+    while(b->flushing){
+        pthread_cond_wait(&sh->flushed, &sh->lock);
+    }
+    if(!b->dirty){
+        return( 0 );
+    }
+
+    if(cacheWriter == NULL || cacheWriter(b->device, b->sector, b->block, cache_data(sh, i))){
+        logMessage( LOG_ERROR_LEVEL, "Failure writing back cache block [%d/%d/%d].",
+            b->device, b->sector, b->block);
+        return( -1 );
+    }
+    cache_undirty(sh, i);
+    sh->writebacks ++;
     return( 0 );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcloud_closecache
-// Description  : Clean up the cache when program is closing
+// Function     : cache_take
+// Description  : Take a dirty block for a writeback outside the shard lock,
+//                copying its data out and marking it as being flushed
+//
+// Inputs       : sh - the shard of the block, locked by the caller
+//                i - index of the block in the shard
+//                f - where to record the block
+//                key - where to put the key of the block
+//                buf - where to copy the data
+// Outputs      : none
+
+static void cache_take( cacheShard *sh, int i, cacheFlush *f, LcCacheKey *key, char *buf ) {
+    cacheBlock *b = &sh->blocks[i];
+
+    b->flushing = 1;
+    sh->flushingCount ++;
+    f->sh = sh;
+    f->i = i;
+    f->gen = b->gen;
+    key->device = b->device;
+    key->sector = b->sector;
+    key->block = b->block;
+    memcpy(buf, cache_data(sh, i), LC_DEVICE_BLOCK_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_writeout
+// Description  : Write the blocks taken by cache_take back in one batch, with
+//                no shard locked, then mark clean the ones that did not
+//                change in the meantime
+//
+// Inputs       : flush - the blocks taken
+//                keys - their keys
+//                bufs - copies of their data
+//                count - number of blocks
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_writeout( cacheFlush *flush, LcCacheKey *keys, char **bufs, int count ) {
+    int ret = 0;
+
+    if(count == 0){
+        return( 0 );
+    }
+
+    if(cacheBatchWriter != NULL){
+        ret = cacheBatchWriter(keys, bufs, count);
+    } else {
+        for(int k = 0; ret == 0 && k < count; k++){
+            ret = (cacheWriter == NULL) ? -1 : cacheWriter(keys[k].device, keys[k].sector, keys[k].block, bufs[k]);
+        }
+    }
+    if(ret){
+        logMessage( LOG_ERROR_LEVEL, "Failure writing back a batch of [%d] cache blocks.", count);
+    }
+
+    for(int k = 0; k < count; k++){
+        cacheShard *sh = flush[k].sh;
+        cacheBlock *b = &sh->blocks[flush[k].i];
+
+        pthread_mutex_lock(&sh->lock);
+        if(ret == 0 && b->gen == flush[k].gen){
+            cache_undirty(sh, flush[k].i);
+            sh->writebacks ++;
+        }
+        b->flushing = 0;
+        sh->flushingCount --;
+        pthread_cond_broadcast(&sh->flushed);
+        pthread_mutex_unlock(&sh->lock);
+    }
+    return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_flushpass
+// Description  : Write back, in batches, the oldest dirty blocks of every
+//                shard past its high watermark (down to the low watermark)
+//                and every block dirty for longer than the maximum age
 //
 // Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
 
-int lcloud_closecache( void ) {
+static int cache_flushpass( void ) {
+    cacheFlush flush[LC_CACHE_FLUSH_BATCH];
+    LcCacheKey keys[LC_CACHE_FLUSH_BATCH];
+    char data[LC_CACHE_FLUSH_BATCH][LC_DEVICE_BLOCK_SIZE];
+    char *bufs[LC_CACHE_FLUSH_BATCH];
+    int ret = 0, n, excess;
+    long now;
 
-    float hitRatio;
-    hitRatio = (float)cacheHits/(float)(cacheHits + cacheMisses);
+    for(int k = 0; k < LC_CACHE_FLUSH_BATCH; k++){
+        bufs[k] = data[k];
+    }
 
-    free(cache); // Free the memory allocated to the cache
+    for(int s = 0; s < cacheShards; s++){
+        cacheShard *sh = &cache[s];
 
-    printf("\n\nHits: %d | Misses: %d | Hit Ratio : %.2f \n\n", cacheHits, cacheMisses, hitRatio); // Prints out the cache statistics
+        do {
+            n = 0;
+            pthread_mutex_lock(&sh->lock);
+            now = cache_now();
+            excess = (sh->dirtyCount*100 > dirtyHigh*sh->size) ? sh->dirtyCount - dirtyLow*sh->size/100 : 0;
 
-    /* Return successfully */
-    return( 0 );
-}
\ No newline at end of file
+            // The dirty list is oldest first, stop at the first block young enough once the watermark is met
+            for(int i = sh->dirtyOldest; i != LC_CACHE_NONE && n < LC_CACHE_FLUSH_BATCH; i = sh->blocks[i].dirtyNext){
+                if(excess <= 0 && now - sh->blocks[i].dirtyTime <= dirtyMaxAge){
+                    break;
+                }
+                if(!sh->blocks[i].flushing){
+                    cache_take(sh, i, &flush[n], &keys[n], bufs[n]);
+                    n ++;
+                }
+                excess --;
+            }
+            pthread_mutex_unlock(&sh->lock);
+
+            if(cache_writeout(flush, keys, bufs, n)){
+                ret = -1;
+                break;
+            }
+        } while(n == LC_CACHE_FLUSH_BATCH);
+    }
+    return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_flusher
+// Description  : The flusher thread, which runs a flush pass a few times per
+//                maximum age (so no block stays dirty much past it, even when
+//                the cache is idle) and whenever a shard passes its high
+//                watermark
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+static void * cache_flusher( void *arg ) {
+    struct timespec wake;
+    long interval;
+
+    pthread_mutex_lock(&flusherLock);
+    while(!flusherStop){
+        interval = (dirtyMaxAge/4 > 0) ? dirtyMaxAge/4 : 1;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += interval/1000;
+        wake.tv_nsec += (interval%1000)*1000000L;
+        if(wake.tv_nsec >= 1000000000L){
+            wake.tv_sec ++;
+            wake.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&flusherWake, &flusherLock, &wake);
+        if(flusherStop){
+            break;
+        }
+
+        pthread_mutex_unlock(&flusherLock);
+        cache_flushpass();
+        pthread_mutex_lock(&flusherLock);
+    }
+    pthread_mutex_unlock(&flusherLock);
+    return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_stopflusher
+// Description  : Stop the flusher thread if it is running
+//
+// Inputs       : none
+// Outputs      : none
+
+static void cache_stopflusher( void ) {
+    if(!flusherRunning){
+        return;
+    }
+    pthread_mutex_lock(&flusherLock);
+    flusherStop = 1;
+    pthread_cond_signal(&flusherWake);
+    pthread_mutex_unlock(&flusherLock);
+    pthread_join(flusher, NULL);
+    flusherRunning = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_evictable
+// Description  : Tell the replacement policy if a block may be evicted
+//
+// Inputs       : ctx - the shard of the block
+//                i - index of the block in the shard
+// Outputs      : 1 if the block is not pinned or being flushed, 0 if it is
+
+static int cache_evictable( void *ctx, int i ) {
+    return( ((cacheShard *)ctx)->blocks[i].pins == 0 && !((cacheShard *)ctx)->blocks[i].flushing );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_getcache
+// Description  : Search the cache for a block
+//
+//                The pointer returned points into the cache itself, so it
+//                is only stable until the block is next evicted.
+//
+// Inputs       : did - device number of block to find
+//                sec - sector number of block to find
+//                blk - block number of block to find
+// Outputs      : cache block if found (pointer), NULL if not or failure
+
+char * lcloud_getcache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+
+    cacheShard *sh = cache_shard(did, sec, blk);
+    char *data = NULL;
+    int i;
+
+    pthread_mutex_lock(&sh->lock);
+    i = cache_findverified(sh, did, sec, blk);
+    cache_mrc(sh, cache_key(did, sec, blk), 1);
+
+    if(i != LC_CACHE_NONE){ // Check if it is a cache hit
+
+        // Let the policy know the block was used
+        lcloud_policy_access(&sh->pol, i);
+
+        cache_count(sh, did, 1); // Update the cache hits value
+        data = cache_data(sh, i); // Returns the pointer to the cache data
+    } else {
+        cache_count(sh, did, 0); // Increment the cache misses counter
+    }
+
+    pthread_mutex_unlock(&sh->lock);
+    return( data );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_pincache
+// Description  : Search the cache for a block and pin it, so the data can be
+//                used in place until lcloud_unpincache without the block
+//                being evicted
+//
+// Inputs       : did - device number of block to find
+//                sec - sector number of block to find
+//                blk - block number of block to find
+// Outputs      : cache block if found (pointer), NULL if not or failure
+
+char * lcloud_pincache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+
+    cacheShard *sh = cache_shard(did, sec, blk);
+    char *data = NULL;
+    int i;
+
+    pthread_mutex_lock(&sh->lock);
+    i = cache_findverified(sh, did, sec, blk);
+    cache_mrc(sh, cache_key(did, sec, blk), 1);
+
+    if(i != LC_CACHE_NONE){
+        lcloud_policy_access(&sh->pol, i);
+        sh->blocks[i].pins ++;
+        cache_count(sh, did, 1);
+        data = cache_data(sh, i);
+    } else {
+        cache_count(sh, did, 0);
+    }
+
+    pthread_mutex_unlock(&sh->lock);
+    return( data );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_unpincache
+// Description  : Release a block pinned by lcloud_pincache
+//
+// Inputs       : did - device number of the block
+//                sec - sector number of the block
+//                blk - block number of the block
+// Outputs      : 0 if successful, -1 if the block was not pinned
+
+int lcloud_unpincache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+
+    cacheShard *sh = cache_shard(did, sec, blk);
+    int i, ret = -1;
+
+    pthread_mutex_lock(&sh->lock);
+    i = cache_find(sh, did, sec, blk);
+    if(i != LC_CACHE_NONE && sh->blocks[i].pins > 0){
+        sh->blocks[i].pins --;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    if(ret){
+        logMessage( LOG_ERROR_LEVEL, "Unpinning cache block [%d/%d/%d] that is not pinned.", did, sec, blk);
+    }
+    return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_incache
+// Description  : Check if a block is cached, without counting a hit or a
+//                miss or changing its place in the replacement order
+//
+// Inputs       : did - device number of the block
+//                sec - sector number of the block
+//                blk - block number of the block
+// Outputs      : 1 if the block is cached, 0 if not
+
+int lcloud_incache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+
+    cacheShard *sh = cache_shard(did, sec, blk);
+    int found;
+
+    pthread_mutex_lock(&sh->lock);
+    found = (cache_findverified(sh, did, sec, blk) != LC_CACHE_NONE);
+    pthread_mutex_unlock(&sh->lock);
+    return( found );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_samecache
+// Description  : Check if a block is cached holding exactly the given data,
+//                without counting a hit or a miss
+//
+// Inputs       : did - device number of the block
+//                sec - sector number of the block
+//                blk - block number of the block
+//                block - the data to compare with
+// Outputs      : 1 if the cached copy is the same, 0 if it differs, the
+//                block is not cached or its data is an unverified snapshot
+//                copy (only a device read or write this session counts)
+
+int lcloud_samecache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+
+    cacheShard *sh = cache_shard(did, sec, blk);
+    int i, same = 0;
+
+    pthread_mutex_lock(&sh->lock);
+    if((i = cache_findverified(sh, did, sec, blk)) != LC_CACHE_NONE){
+        same = (memcmp(cache_data(sh, i), block, LC_DEVICE_BLOCK_SIZE) == 0);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return( same );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_dropcache
+// Description  : Remove a block from the cache without writing it back, for
+//                when its data no longer matters
+//
+// Inputs       : did - device number of the block
+//                sec - sector number of the block
+//                blk - block number of the block
+// Outputs      : 0 if the block is no longer cached, -1 if it is pinned or
+//                being written back
+
+int lcloud_dropcache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+
+    cacheShard *sh = cache_shard(did, sec, blk);
+    int i, ret = 0;
+
+    pthread_mutex_lock(&sh->lock);
+    if((i = cache_find(sh, did, sec, blk)) != LC_CACHE_NONE){
+        if(sh->blocks[i].pins > 0 || sh->blocks[i].flushing){
+            ret = -1;
+        } else {
+            cache_undirty(sh, i);
+            lcloud_policy_remove(&sh->pol, i, cache_key(did, sec, blk));
+            cache_unindex(sh, i);
+
+            // A free slot holds no key, so nothing (the snapshot included) mistakes it for a cached block
+            sh->blocks[i].device = -1;
+            sh->blocks[i].sector = -1;
+            sh->blocks[i].block = -1;
+            sh->blocks[i].verified = 0;
+            sh->blocks[i].hashNext = sh->freeList;
+            sh->freeList = i;
+        }
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_insert
+// Description  : Put a value in the cache, evicting (and writing back) a
+//                block if the shard is full
+//
+// Inputs       : sh - the shard of the block, locked by the caller
+//                did - device number of block to insert
+//                sec - sector number of block to insert
+//                blk - block number of block to insert
+//                block - the data of the block
+//                dirty - 1 if the block has not been written to the device
+// Outputs      : 0 if succesfully inserted, -1 if failure
+
+static int cache_insert( cacheShard *sh, LcDeviceId did, uint16_t sec, uint16_t blk, char *block, int dirty ) {
+
+    int i = cache_find(sh, did, sec, blk);
+    uint64_t key = cache_key(did, sec, blk);
+    uint64_t victimKey;
+    int bucket;
+
+    cache_mrc(sh, key, 0);
+
+    if(i != LC_CACHE_NONE){ // Check if it is a cache hit
+
+        // Update the cache data
+        memcpy(cache_data(sh, i), block, LC_DEVICE_BLOCK_SIZE);
+        sh->blocks[i].gen ++;
+        sh->blocks[i].verified = 1;
+        if(dirty){
+            cache_dirty(sh, i);
+        } else {
+            cache_undirty(sh, i);
+        }
+        lcloud_policy_access(&sh->pol, i);
+        return(0);
+    }
+
+    // With every block in use and some being written back, wait for the writebacks to finish
+    while(sh->freeList == LC_CACHE_NONE && sh->flushingCount > 0 &&
+        (i = lcloud_policy_victim(&sh->pol, cache_evictable, sh)) == LC_CACHE_NONE){
+        pthread_cond_wait(&sh->flushed, &sh->lock);
+    }
+
+    if(sh->freeList != LC_CACHE_NONE){ // Take an empty block if there is one
+        i = sh->freeList;
+        sh->freeList = sh->blocks[i].hashNext;
+    } else if(i != LC_CACHE_NONE || (i = lcloud_policy_victim(&sh->pol, cache_evictable, sh)) != LC_CACHE_NONE){ // Otherwise ask the policy for an unpinned victim
+        victimKey = cache_key(sh->blocks[i].device, sh->blocks[i].sector, sh->blocks[i].block);
+
+        // The victim's latest data has to reach the device before the block is reused
+        if(cache_clean(sh, i)){
+            return( -1 );
+        }
+
+        lcloud_policy_remove(&sh->pol, i, victimKey);
+        cache_unindex(sh, i);
+        sh->evictions ++;
+    } else {
+        /* Return a -1 if the cache has no blocks (or all of them are pinned) */
+        return( -1 );
+    }
+
+    // Populate the block with the info to be put into the cache
+    sh->blocks[i].block = blk;
+    sh->blocks[i].sector = sec;
+    sh->blocks[i].device = did;
+    memcpy(cache_data(sh, i), block, LC_DEVICE_BLOCK_SIZE); // Copies over the passed data into the cache
+    sh->blocks[i].gen ++;
+
+    // Add the block to the index and hand it to the policy
+    bucket = cache_hash(did, sec, blk) & sh->indexMask;
+    sh->blocks[i].hashNext = sh->index[bucket];
+    sh->index[bucket] = i;
+    lcloud_policy_insert(&sh->pol, i, key);
+    sh->blocks[i].dirty = 0;
+    sh->blocks[i].pins = 0;
+    sh->blocks[i].flushing = 0;
+    sh->blocks[i].verified = 1;
+    if(dirty){
+        cache_dirty(sh, i);
+    }
+
+    cache_count(sh, did, 0); // Count this as a cache miss
+
+    return ( 0 ); // Returns a 0 for success
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_putcache
+// Description  : Put a value in the cache
+//
+// Inputs       : did - device number of block to insert
+//                sec - sector number of block to insert
+//                blk - block number of block to insert
+// Outputs      : 0 if succesfully inserted, -1 if failure
+
+int lcloud_putcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+    cacheShard *sh = cache_shard(did, sec, blk);
+    int ret;
+
+    pthread_mutex_lock(&sh->lock);
+    ret = cache_insert(sh, did, sec, blk, block, 0);
+    pthread_mutex_unlock(&sh->lock);
+    return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_writecache
+// Description  : Put a modified block in the cache, leaving it to be written
+//                back on eviction, on a flush or by the flusher thread, which
+//                is woken once the shard passes its high watermark
+//
+// Inputs       : did - device number of block to write
+//                sec - sector number of block to write
+//                blk - block number of block to write
+//                block - the new data of the block
+// Outputs      : 0 if succesfully inserted, -1 if failure
+
+int lcloud_writecache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+    cacheShard *sh = cache_shard(did, sec, blk);
+    int ret;
+
+    pthread_mutex_lock(&sh->lock);
+    ret = cache_insert(sh, did, sec, blk, block, 1);
+    if(ret == 0 && sh->dirtyCount*100 > dirtyHigh*sh->size){
+        pthread_mutex_lock(&flusherLock);
+        pthread_cond_signal(&flusherWake);
+        pthread_mutex_unlock(&flusherLock);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_flushblock
+// Description  : Write a block back to its device if it is dirty
+//
+// Inputs       : did - device number of block to flush
+//                sec - sector number of block to flush
+//                blk - block number of block to flush
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_flushblock( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+    cacheShard *sh = cache_shard(did, sec, blk);
+    int i, ret = 0;
+
+    pthread_mutex_lock(&sh->lock);
+    if((i = cache_find(sh, did, sec, blk)) != LC_CACHE_NONE){
+        ret = cache_clean(sh, i);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_flushblocks
+// Description  : Write the dirty blocks among a set back to their devices, in
+//                batches sent with no shard locked
+//
+// Inputs       : keys - the blocks
+//                count - number of blocks
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_flushblocks( LcCacheKey *keys, int count ) {
+    cacheFlush flush[LC_CACHE_FLUSH_BATCH];
+    LcCacheKey taken[LC_CACHE_FLUSH_BATCH];
+    char data[LC_CACHE_FLUSH_BATCH][LC_DEVICE_BLOCK_SIZE];
+    char *bufs[LC_CACHE_FLUSH_BATCH];
+    int n = 0, i;
+
+    for(int k = 0; k < LC_CACHE_FLUSH_BATCH; k++){
+        bufs[k] = data[k];
+    }
+
+    for(int k = 0; k < count; k++){
+        cacheShard *sh = cache_shard(keys[k].device, keys[k].sector, keys[k].block);
+
+        pthread_mutex_lock(&sh->lock);
+        if((i = cache_find(sh, keys[k].device, keys[k].sector, keys[k].block)) != LC_CACHE_NONE){
+
+            // Send what is taken before waiting on a writeback of this block already under way
+            if(sh->blocks[i].flushing && n > 0){
+                pthread_mutex_unlock(&sh->lock);
+                if(cache_writeout(flush, taken, bufs, n)){
+                    return( -1 );
+                }
+                n = 0;
+                pthread_mutex_lock(&sh->lock);
+            }
+            while(sh->blocks[i].flushing){
+                pthread_cond_wait(&sh->flushed, &sh->lock);
+            }
+            if(sh->blocks[i].dirty){
+                cache_take(sh, i, &flush[n], &taken[n], bufs[n]);
+                n ++;
+            }
+        }
+        pthread_mutex_unlock(&sh->lock);
+
+        if(n == LC_CACHE_FLUSH_BATCH){
+            if(cache_writeout(flush, taken, bufs, n)){
+                return( -1 );
+            }
+            n = 0;
+        }
+    }
+    return( cache_writeout(flush, taken, bufs, n) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_flushcache
+// Description  : Write every dirty block back to its device, in batches
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_flushcache( void ) {
+    cacheFlush flush[LC_CACHE_FLUSH_BATCH];
+    LcCacheKey keys[LC_CACHE_FLUSH_BATCH];
+    char data[LC_CACHE_FLUSH_BATCH][LC_DEVICE_BLOCK_SIZE];
+    char *bufs[LC_CACHE_FLUSH_BATCH];
+    int n;
+
+    for(int k = 0; k < LC_CACHE_FLUSH_BATCH; k++){
+        bufs[k] = data[k];
+    }
+
+    for(int s = 0; s < cacheShards; s++){
+        cacheShard *sh = &cache[s];
+
+        pthread_mutex_lock(&sh->lock);
+        while(sh->dirtyCount > 0){
+            n = 0;
+            for(int i = sh->dirtyOldest; i != LC_CACHE_NONE && n < LC_CACHE_FLUSH_BATCH; i = sh->blocks[i].dirtyNext){
+                if(!sh->blocks[i].flushing){
+                    cache_take(sh, i, &flush[n], &keys[n], bufs[n]);
+                    n ++;
+                }
+            }
+
+            // Everything left dirty is being written back by the flusher, wait for it
+            if(n == 0){
+                pthread_cond_wait(&sh->flushed, &sh->lock);
+                continue;
+            }
+            pthread_mutex_unlock(&sh->lock);
+            if(cache_writeout(flush, keys, bufs, n)){
+                return( -1 );
+            }
+            pthread_mutex_lock(&sh->lock);
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcachewriter
+// Description  : Set the function used to write dirty blocks to the devices
+//
+// Inputs       : writer - the write function
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_setcachewriter( LcCacheWriter writer ) {
+    cacheWriter = writer;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcachebatchwriter
+// Description  : Set the function used to write batches of dirty blocks to
+//                the devices, by the flusher and the batched flushes
+//
+// Inputs       : writer - the batch write function, NULL to use the single
+//                block writer
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_setcachebatchwriter( LcCacheBatchWriter writer ) {
+    cacheBatchWriter = writer;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setwriteback
+// Description  : Turn write-back mode on or off and set when dirty blocks
+//                are flushed, starting the flusher thread for write-back
+//
+// Inputs       : enable - 1 for write-back, 0 for write-through
+//                high - percent of the cache dirty before flushing starts
+//                low - percent of the cache left dirty after flushing
+//                maxage - longest time (in ms) a block may stay dirty
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_setwriteback( int enable, int high, int low, int maxage ) {
+    if(high < 0 || high > 100 || low < 0 || low > high || maxage < 0){
+        logMessage( LOG_ERROR_LEVEL, "Bad write-back settings [%d/%d/%d].", high, low, maxage);
+        return( -1 );
+    }
+
+    // Leaving write-back mode must not leave unwritten blocks behind
+    if(!enable){
+        cache_stopflusher();
+        if(lcloud_flushcache()){
+            return( -1 );
+        }
+    }
+
+    writeBack = enable;
+    dirtyHigh = high;
+    dirtyLow = low;
+    dirtyMaxAge = maxage;
+
+    if(enable && !flusherRunning){
+        flusherStop = 0;
+        if(pthread_create(&flusher, NULL, cache_flusher, NULL)){
+            logMessage( LOG_ERROR_LEVEL, "Unable to start the cache flusher.");
+            return( -1 );
+        }
+        flusherRunning = 1;
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_writebackcache
+// Description  : Check if the cache is in write-back mode
+//
+// Inputs       : none
+// Outputs      : 1 if writes should go to lcloud_writecache, 0 if not
+
+int lcloud_writebackcache( void ) {
+    return( writeBack );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cachemrc
+// Description  : Estimate the hit ratio an LRU cache of a given size would
+//                have had on the lookups seen so far
+//
+// Inputs       : blocks - the cache size to estimate for
+// Outputs      : the estimated hit ratio, -1 if the tracker is off or has
+//                not sampled anything yet
+
+float lcloud_cachemrc( int blocks ) {
+    long hits = 0, samples = 0;
+
+    if(mrcRate == 0){
+        return( -1 );
+    }
+
+    // A sampled distance d in one shard stands for a real one of about d*rate*shards
+    for(int s = 0; s < cacheShards; s++){
+        cacheMrc *m = &cache[s].mrc;
+
+        pthread_mutex_lock(&cache[s].lock);
+        for(long d = 0; d < m->keysMax && d*mrcRate*cacheShards < blocks; d++){
+            hits += m->hist[d];
+        }
+        samples += m->samples;
+        pthread_mutex_unlock(&cache[s].lock);
+    }
+    if(samples == 0){
+        return( -1 );
+    }
+    return( (float)hits/(float)samples );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cachestats
+// Description  : Take a snapshot of the cache counters, adding up every
+//                shard (each shard is locked only while it is read)
+//
+// Inputs       : stats - where to put the counters
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_cachestats( LcCacheStats *stats ) {
+    memset(stats, 0, sizeof(LcCacheStats));
+    stats->blocks = cacheSize;
+    stats->shards = cacheShards;
+    stats->arenaBytes = cacheArenaSize;
+    stats->hugePages = cacheArenaHuge;
+
+    // Estimate the curve from 1/8 to 256 times the current size
+    for(int k = 0; k < LC_CACHE_MRC_POINTS; k++){
+        stats->mrcSizes[k] = (k < 3) ? cacheSize >> (3-k) : cacheSize << (k-3);
+        stats->mrcHitRatio[k] = lcloud_cachemrc(stats->mrcSizes[k]);
+    }
+
+    for(int s = 0; s < cacheShards; s++){
+        pthread_mutex_lock(&cache[s].lock);
+        stats->hits += cache[s].hits;
+        stats->misses += cache[s].misses;
+        stats->evictions += cache[s].evictions;
+        stats->writebacks += cache[s].writebacks;
+        stats->dirty += cache[s].dirtyCount;
+        stats->mrcSamples += cache[s].mrc.samples;
+        for(int d = 0; d < LC_CACHE_MAXDEVICES; d++){
+            stats->devHits[d] += cache[s].devHits[d];
+            stats->devMisses[d] += cache[s].devMisses[d];
+        }
+        pthread_mutex_unlock(&cache[s].lock);
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_checksum
+// Description  : Compute the validation tag (FNV-1a) of a snapshot record,
+//                which catches a damaged file but says nothing about what
+//                the devices hold now
+//
+// Inputs       : key - the key of the block
+//                data - the data of the block
+// Outputs      : the checksum
+
+static uint32_t cache_checksum( uint64_t key, const char *data ) {
+    uint32_t sum = 2166136261u;
+
+    for(int i = 0; i < 8; i++){
+        sum = (sum ^ (uint8_t)(key >> (8*i))) * 16777619u;
+    }
+    for(int i = 0; i < LC_DEVICE_BLOCK_SIZE; i++){
+        sum = (sum ^ (uint8_t)data[i]) * 16777619u;
+    }
+    return( sum );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_resetstats
+// Description  : Zero the counters of every shard, so warming the cache up
+//                does not show up as misses
+//
+// Inputs       : none
+// Outputs      : none
+
+static void cache_resetstats( void ) {
+    for(int s = 0; s < cacheShards; s++){
+        pthread_mutex_lock(&cache[s].lock);
+        cache[s].hits = 0;
+        cache[s].misses = 0;
+        cache[s].evictions = 0;
+        memset(cache[s].devHits, 0, sizeof(cache[s].devHits));
+        memset(cache[s].devMisses, 0, sizeof(cache[s].devMisses));
+        pthread_mutex_unlock(&cache[s].lock);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_savesnapshot
+// Description  : Write the keys of every clean, verified cached block (and
+//                their data if asked for) to the snapshot file
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_savesnapshot( void ) {
+    char tmpPath[256];
+    uint32_t header[3] = { snapshotData ? LC_CACHE_SNAPSHOT_DATA : 0, 0, LC_DEVICE_BLOCK_SIZE };
+    FILE *fp;
+
+    // Write a new file and move it over the old one, so a crash never leaves half a snapshot
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", snapshotPath);
+    if((fp = fopen(tmpPath, "wb")) == NULL){
+        logMessage( LOG_ERROR_LEVEL, "Unable to write cache snapshot [%s].", tmpPath);
+        return( -1 );
+    }
+
+    for(int s = 0; s < cacheShards; s++){
+        for(int i = 0; i < cache[s].size; i++){
+            header[1] += (cache[s].blocks[i].device != -1 && !cache[s].blocks[i].dirty && cache[s].blocks[i].verified);
+        }
+    }
+    fwrite(LC_CACHE_SNAPSHOT_MAGIC, 1, 8, fp);
+    fwrite(header, sizeof(uint32_t), 3, fp);
+
+    for(int s = 0; s < cacheShards; s++){
+        for(int i = 0; i < cache[s].size; i++){
+            cacheBlock *b = &cache[s].blocks[i];
+            uint64_t key;
+            uint32_t sum;
+
+            // Dirty blocks never reached the device and unverified ones were never checked against it,
+            // so neither can be trusted on reload
+            if(b->device == -1 || b->dirty || !b->verified){
+                continue;
+            }
+            key = cache_key(b->device, b->sector, b->block);
+            fwrite(&key, sizeof(key), 1, fp);
+            if(snapshotData){
+                sum = cache_checksum(key, cache_data(&cache[s], i));
+                fwrite(&sum, sizeof(sum), 1, fp);
+                fwrite(cache_data(&cache[s], i), 1, LC_DEVICE_BLOCK_SIZE, fp);
+            }
+        }
+    }
+
+    if(ferror(fp) | fclose(fp) || rename(tmpPath, snapshotPath)){
+        logMessage( LOG_ERROR_LEVEL, "Unable to write cache snapshot [%s].", snapshotPath);
+        remove(tmpPath);
+        return( -1 );
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_loadsnapshot
+// Description  : Read the snapshot file, keeping its keys to be read from
+//                the devices by lcloud_warmcache. Blocks whose data checks
+//                out go into the cache unverified, so lookups miss them
+//                until a device read or write confirms the data.
+//
+// Inputs       : none
+// Outputs      : 0 if successful (or there is no snapshot), -1 if failure
+
+static int cache_loadsnapshot( void ) {
+    char magic[8];
+    uint32_t header[3];
+    char data[LC_DEVICE_BLOCK_SIZE];
+    uint64_t key;
+    uint32_t sum;
+    FILE *fp;
+
+    if((fp = fopen(snapshotPath, "rb")) == NULL){
+        return( 0 ); // Nothing saved yet
+    }
+
+    if(fread(magic, 1, 8, fp) != 8 || memcmp(magic, LC_CACHE_SNAPSHOT_MAGIC, 8) ||
+        fread(header, sizeof(uint32_t), 3, fp) != 3 || header[2] != LC_DEVICE_BLOCK_SIZE){
+        logMessage( LOG_ERROR_LEVEL, "Ignoring bad cache snapshot [%s].", snapshotPath);
+        fclose(fp);
+        return( 0 );
+    }
+
+    free(warmKeys);
+    warmCount = 0;
+    if((warmKeys = malloc(((size_t)header[1] + 1)*sizeof(uint64_t))) == NULL){
+        fclose(fp);
+        return( -1 );
+    }
+
+    for(uint32_t n = 0; n < header[1] && fread(&key, sizeof(key), 1, fp) == 1; n++){
+        int did = (int)(key >> 32), sec = (int)((key >> 16) & 0xffff), blk = (int)(key & 0xffff);
+
+        if(header[0] & LC_CACHE_SNAPSHOT_DATA){
+            if(fread(&sum, sizeof(sum), 1, fp) != 1 || fread(data, 1, LC_DEVICE_BLOCK_SIZE, fp) != LC_DEVICE_BLOCK_SIZE){
+                break;
+            }
+
+            // The tag only shows the file is intact, not that the device still
+            // holds this data, so the block stays hidden until it is read again
+            if(sum == cache_checksum(key, data)){
+                cacheShard *sh = cache_shard(did, sec, blk);
+                int i;
+
+                pthread_mutex_lock(&sh->lock);
+                if(cache_insert(sh, did, sec, blk, data, 0) == 0 && (i = cache_find(sh, did, sec, blk)) != LC_CACHE_NONE){
+                    sh->blocks[i].verified = 0;
+                }
+                pthread_mutex_unlock(&sh->lock);
+            }
+        }
+        warmKeys[warmCount++] = key;
+    }
+    fclose(fp);
+
+    cache_resetstats();
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setsnapshot
+// Description  : Save the cache to a file when it is closed and load it back
+//                the next time it is initialized
+//
+// Inputs       : path - the snapshot file, NULL to turn snapshots off
+//                data - 1 to save block data as well as keys
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_setsnapshot( const char *path, int data ) {
+    free(snapshotPath);
+    snapshotPath = NULL;
+    snapshotData = data;
+    if(path == NULL){
+        return( 0 );
+    }
+
+    if(strlen(path) + 5 > 256 || (snapshotPath = strdup(path)) == NULL){
+        logMessage( LOG_ERROR_LEVEL, "Bad cache snapshot path [%s].", path);
+        return( -1 );
+    }
+    return( cache_loadsnapshot() );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_warmcache
+// Description  : Read the blocks named by the snapshot back into the cache
+//                once the devices are up, replacing (and so verifying) any
+//                snapshot data loaded for them
+//
+// Inputs       : reader - function used to read a block from the devices
+// Outputs      : number of blocks read, -1 if failure
+
+int lcloud_warmcache( LcCacheReader reader ) {
+    char data[LC_DEVICE_BLOCK_SIZE];
+    int warmed = 0;
+
+    for(int n = 0; n < warmCount; n++){
+        int did = (int)(warmKeys[n] >> 32), sec = (int)((warmKeys[n] >> 16) & 0xffff), blk = (int)(warmKeys[n] & 0xffff);
+
+        // Blocks the devices no longer have are dropped, along with any snapshot data for them
+        if(lcloud_incache(did, sec, blk)){
+            continue;
+        }
+        if(reader(did, sec, blk, data) == 0){
+            lcloud_putcache(did, sec, blk, data);
+            warmed ++;
+        } else {
+            lcloud_dropcache(did, sec, blk);
+        }
+    }
+
+    free(warmKeys);
+    warmKeys = NULL;
+    warmCount = 0;
+    if(warmed > 0){
+        cache_resetstats();
+    }
+    return( warmed );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_initcache
+// Description  : Initialze the cache by setting up metadata a cache elements,
+//                using the policy named by LCLOUD_CACHE_POLICY (LRU if unset),
+//                the shard count in LCLOUD_CACHE_SHARDS (sized from
+//                maxblocks if unset), the memory budget in
+//                LCLOUD_CACHE_BYTES (maxblocks if unset), the miss ratio
+//                curve sampling rate in LCLOUD_CACHE_MRC and the snapshot
+//                file in LCLOUD_CACHE_SNAPSHOT
+//
+// Inputs       : maxblocks - the max number number of blocks
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_initcache( int maxblocks ) {
+    LcCachePolicy policy = LC_CACHE_LRU;
+    int tinylfu = 0;
+    int shards = 0;
+    char *spec = getenv("LCLOUD_CACHE_POLICY");
+    char *unit;
+    double bytes;
+
+    if(spec != NULL && lcloud_policy_parse(spec, &policy, &tinylfu)){
+        logMessage( LOG_ERROR_LEVEL, "Unknown cache policy [%s], using lru.", spec);
+        policy = LC_CACHE_LRU;
+        tinylfu = 0;
+    }
+
+    // A memory budget such as 64K, 16M or 1G overrides the block count
+    spec = getenv("LCLOUD_CACHE_BYTES");
+    if(spec != NULL){
+        bytes = strtod(spec, &unit);
+        switch(*unit){
+            case 'G': case 'g': bytes *= 1024;
+            /* fall through */
+            case 'M': case 'm': bytes *= 1024;
+            /* fall through */
+            case 'K': case 'k': bytes *= 1024;
+        }
+        maxblocks = lcloud_cacheblocks((size_t)bytes);
+    }
+
+    spec = getenv("LCLOUD_CACHE_SHARDS");
+    if(spec != NULL){
+        shards = atoi(spec);
+    }
+
+    if(lcloud_initcacheshards(maxblocks, shards, policy, tinylfu)){
+        return( -1 );
+    }
+
+    // LCLOUD_CACHE_MRC=<rate> turns on the miss ratio curve, sampling one key in rate
+    spec = getenv("LCLOUD_CACHE_MRC");
+    if(spec != NULL && cache_mrcinit(atoi(spec))){
+        return( -1 );
+    }
+
+    // LCLOUD_CACHE_SNAPSHOT=<file> keeps the cache warm across restarts, LCLOUD_CACHE_SNAPSHOT_DATA=1 saves the data too
+    spec = getenv("LCLOUD_CACHE_SNAPSHOT");
+    if(spec != NULL && *spec != '\0'){
+        char *data = getenv("LCLOUD_CACHE_SNAPSHOT_DATA");
+
+        if(lcloud_setsnapshot(spec, data != NULL && strcmp(data, "1") == 0)){
+            return( -1 );
+        }
+    }
+
+    // Write-back is opt in, LCLOUD_CACHE_WRITEBACK=<high%>,<low%>,<max age ms> tunes the flushing
+    spec = getenv("LCLOUD_CACHE_WRITEBACK");
+    if(spec != NULL && strcmp(spec, "0") != 0){
+        int high = LC_CACHE_DIRTY_HIGH, low = LC_CACHE_DIRTY_LOW, maxage = LC_CACHE_DIRTY_MAXAGE;
+
+        if(strchr(spec, ',') != NULL){
+            sscanf(spec, "%d,%d,%d", &high, &low, &maxage);
+        }
+        if(lcloud_setwriteback(1, high, low, maxage)){
+            return( -1 );
+        }
+    }
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cacheblocks
+// Description  : Work out how many blocks fit in a memory budget, counting
+//                each block's data and metadata
+//
+// Inputs       : bytes - the memory budget
+// Outputs      : number of blocks
+
+int lcloud_cacheblocks( size_t bytes ) {
+    size_t blocks = bytes/(LC_DEVICE_BLOCK_SIZE + sizeof(cacheBlock) + 2*sizeof(int));
+
+    if(blocks > LC_CACHE_MAXBUDGET){
+        blocks = LC_CACHE_MAXBUDGET;
+    }
+    return( (blocks > 0) ? (int)blocks : 1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_initcachebytes
+// Description  : Initialze the cache sized by a memory budget
+//
+// Inputs       : bytes - the memory budget
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_initcachebytes( size_t bytes ) {
+    return( lcloud_initcacheshards(lcloud_cacheblocks(bytes), 0, LC_CACHE_LRU, 0) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_initcachepolicy
+// Description  : Initialze the cache with a given replacement policy
+//
+// Inputs       : maxblocks - the max number number of blocks
+//                policy - the replacement policy
+//                tinylfu - 1 to filter admissions with W-TinyLFU
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_initcachepolicy( int maxblocks, LcCachePolicy policy, int tinylfu ) {
+    return( lcloud_initcacheshards(maxblocks, 0, policy, tinylfu) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_initcacheshards
+// Description  : Initialze the cache split into a number of shards, failing
+//                if a cache is already set up (lcloud_closecache it first)
+//
+// Inputs       : maxblocks - the max number number of blocks
+//                shards - number of shards, 0 to size it from maxblocks
+//                policy - the replacement policy of every shard
+//                tinylfu - 1 to filter admissions with W-TinyLFU
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_initcacheshards( int maxblocks, int shards, LcCachePolicy policy, int tinylfu ) {
+    int count = 1;
+    char *data; // Start of the next shard's data in the arena
+
+    if(maxblocks <= 0){
+        logMessage( LOG_ERROR_LEVEL, "Bad cache size [%d].", maxblocks);
+        return( -1 );
+    }
+
+    // The cache in use may hold dirty blocks, it has to be closed before a new one is set up
+    if(cache != NULL){
+        logMessage( LOG_ERROR_LEVEL, "The cache is already initialized.");
+        return( -1 );
+    }
+
+    // Round the shard count down to a power of 2 that leaves every shard a block
+    if(shards <= 0){
+        shards = maxblocks/LC_CACHE_SHARDBLOCKS;
+    }
+    while(count*2 <= shards && count*2 <= LC_CACHE_MAXSHARDS && count*2 <= maxblocks){
+        count *= 2;
+    }
+
+    cache = calloc(count, sizeof(cacheShard));
+    if(cache == NULL){
+        logMessage( LOG_ERROR_LEVEL, "Unable to allocate cache of [%d] blocks.", maxblocks);
+        return( -1 );
+    }
+    cacheShards = count;
+    cacheSize = maxblocks;
+
+    // The data of every block goes in one arena, away from the metadata
+    if(cache_arena((size_t)maxblocks*LC_DEVICE_BLOCK_SIZE)){
+        return( -1 );
+    }
+    data = cacheArena;
+
+    for(int s = 0; s < count; s++){
+        cacheShard *sh = &cache[s];
+        int buckets = 1;
+
+        // Spread the blocks evenly, the first shards take the remainder
+        sh->size = maxblocks/count + (s < maxblocks%count);
+
+        // Keep the load factor of the index at or below 1/2
+        while(buckets < 2*sh->size){
+            buckets <<= 1;
+        }
+
+        // Allocate memory for the shard's metadata based on its size, aligned to a cache line
+        if(posix_memalign((void **)&sh->blocks, LC_CACHE_LINE, sh->size*sizeof(cacheBlock))){
+            sh->blocks = NULL;
+        }
+        sh->index = malloc(buckets*sizeof(int));
+        sh->data = data;
+        data += (size_t)sh->size*LC_DEVICE_BLOCK_SIZE;
+        if(sh->blocks == NULL || sh->index == NULL){
+            logMessage( LOG_ERROR_LEVEL, "Unable to allocate cache of [%d] blocks.", maxblocks);
+            return( -1 );
+        }
+        sh->indexMask = buckets - 1;
+
+        // Initialize all of cache blocks to have a location of -1,-1,-1 and chain them into the free list
+        for(int i = 0; i < sh->size; i++){
+            sh->blocks[i].device = -1;
+            sh->blocks[i].sector = -1;
+            sh->blocks[i].block = -1;
+            sh->blocks[i].dirty = 0;
+            sh->blocks[i].pins = 0;
+            sh->blocks[i].flushing = 0;
+            sh->blocks[i].gen = 0;
+            sh->blocks[i].verified = 0;
+            sh->blocks[i].hashNext = (i+1 < sh->size) ? i+1 : LC_CACHE_NONE;
+        }
+        for(int i = 0; i < buckets; i++){
+            sh->index[i] = LC_CACHE_NONE;
+        }
+        sh->freeList = 0;
+        sh->dirtyOldest = LC_CACHE_NONE;
+        sh->dirtyNewest = LC_CACHE_NONE;
+        sh->dirtyCount = 0;
+        sh->hits = 0; // Set the initial value of hits to 0
+        sh->misses = 0; // Set the initial value of misses to 0
+
+        if(lcloud_policy_init(&sh->pol, policy, tinylfu, sh->size)){
+            return( -1 );
+        }
+        pthread_mutex_init(&sh->lock, NULL);
+        pthread_cond_init(&sh->flushed, NULL);
+    }
+
+    // The trackers stay off unless LCLOUD_CACHE_MRC asks for them
+    mrcRate = 0;
+
+    writeBack = 0;
+    dirtyHigh = LC_CACHE_DIRTY_HIGH;
+    dirtyLow = LC_CACHE_DIRTY_LOW;
+    dirtyMaxAge = LC_CACHE_DIRTY_MAXAGE;
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_closecache
+// Description  : Clean up the cache when program is closing
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_closecache( void ) {
+
+    LcCacheStats stats;
+    float hitRatio;
+
+    // Nothing may be written back once the devices are gone
+    cache_stopflusher();
+
+    lcloud_cachestats(&stats);
+    hitRatio = (float)stats.hits/(float)(stats.hits + stats.misses);
+
+    // Anything still dirty here was never written to a device
+    if(stats.dirty > 0){
+        logMessage( LOG_ERROR_LEVEL, "Closing cache with [%ld] unflushed blocks.", stats.dirty);
+    }
+
+    printf("\n\nPolicy: %s%s | Shards: %d | Hits: %ld | Misses: %ld | Hit Ratio : %.2f | Evictions: %ld | Writebacks: %ld \n\n", cache[0].pol.ops->name,
+        (cache[0].pol.sketch != NULL) ? "+tinylfu" : "", cacheShards, stats.hits, stats.misses, hitRatio, stats.evictions, stats.writebacks); // Prints out the cache statistics
+
+    // Print the estimated hit ratio at other cache sizes
+    if(stats.mrcSamples > 0){
+        printf("Estimated LRU hit ratio by cache size (blocks):");
+        for(int k = 0; k < LC_CACHE_MRC_POINTS; k++){
+            if(stats.mrcSizes[k] > 0){
+                printf(" %d:%.2f", stats.mrcSizes[k], stats.mrcHitRatio[k]);
+            }
+        }
+        printf("\n\n");
+    }
+
+    // Save what is cached for the next run
+    if(snapshotPath != NULL){
+        cache_savesnapshot();
+        lcloud_setsnapshot(NULL, 0);
+    }
+    free(warmKeys);
+    warmKeys = NULL;
+    warmCount = 0;
+
+    // Free the memory allocated to the cache
+    cache_mrcclose();
+    for(int s = 0; s < cacheShards; s++){
+        lcloud_policy_close(&cache[s].pol);
+        free(cache[s].blocks);
+        free(cache[s].index);
+        pthread_mutex_destroy(&cache[s].lock);
+        pthread_cond_destroy(&cache[s].flushed);
+    }
+    free(cache);
+    cache = NULL;
+    cacheShards = 0;
+    munmap(cacheArena, cacheArenaSize);
+    cacheArena = NULL;
+
+    /* Return successfully */
+    return( 0 );
+}
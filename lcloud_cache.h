@@ -14,9 +14,46 @@
 // Includes 
 #include <stdint.h>
 #include <lcloud_controller.h>
+#include <lcloud_cachepolicy.h>
 
 // Defines 
 #define LC_CACHE_MAXBLOCKS 64
+#define LC_CACHE_DIRTY_HIGH 50 // Percent of the cache dirty before write-back flushing starts
+#define LC_CACHE_DIRTY_LOW 25 // Percent of the cache left dirty when flushing stops
+#define LC_CACHE_DIRTY_MAXAGE 1000 // Longest time (in ms) a block may stay dirty
+#define LC_CACHE_FLUSH_BATCH 64 // Most dirty blocks written back in one batch
+#define LC_CACHE_MAXBUDGET (1<<24) // Most blocks a memory budget may ask for (4GB of data)
+#define LC_CACHE_MAXDEVICES 16 // Devices the cache keeps separate statistics for
+#define LC_CACHE_MRC_POINTS 12 // Cache sizes the miss ratio curve is reported at
+
+// Type definitions
+typedef int (*LcCacheWriter)( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
+typedef int (*LcCacheReader)( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
+
+typedef struct LcCacheKey {
+    LcDeviceId device; // Device of the block
+    uint16_t sector; // Sector of the block
+    uint16_t block; // Block within the sector
+} LcCacheKey;
+
+typedef int (*LcCacheBatchWriter)( LcCacheKey *keys, char **blocks, int count );
+
+typedef struct LcCacheStats {
+    int blocks; // Size of the cache in blocks
+    int shards; // Number of shards
+    size_t arenaBytes; // Size of the data arena
+    int hugePages; // 1 if the arena is backed by huge pages
+    long hits; // Lookups that found the block
+    long misses; // Lookups that did not, plus blocks inserted after a miss
+    long evictions; // Blocks pushed out to make room
+    long writebacks; // Dirty blocks written back to the devices
+    long dirty; // Blocks currently dirty
+    long devHits[LC_CACHE_MAXDEVICES]; // Hits by device
+    long devMisses[LC_CACHE_MAXDEVICES]; // Misses by device
+    long mrcSamples; // Lookups sampled by the miss ratio curve tracker
+    int mrcSizes[LC_CACHE_MRC_POINTS]; // Cache sizes (in blocks) of the curve
+    float mrcHitRatio[LC_CACHE_MRC_POINTS]; // Estimated LRU hit ratio at each size, -1 if unknown
+} LcCacheStats;
 
 //
 // Functional Prototypes
@@ -24,12 +61,75 @@
 char * lcloud_getcache( LcDeviceId did, uint16_t sec, uint16_t blk );
     // Search the cache for a block 
 
+char * lcloud_pincache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Search the cache for a block and pin it so it is not evicted while in use
+
+int lcloud_unpincache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Release a block pinned by lcloud_pincache
+
+int lcloud_incache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Check if a block is cached without touching its statistics
+
+int lcloud_samecache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
+    // Check if a block is cached holding exactly the given data
+
+int lcloud_dropcache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Remove a block from the cache without writing it back
+
 int lcloud_putcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
     // Put a value in the cache 
 
+int lcloud_writecache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
+    // Put a modified block in the cache, to be written back later
+
+int lcloud_flushblock( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Write a block back to its device if it is dirty
+
+int lcloud_flushblocks( LcCacheKey *keys, int count );
+    // Write the dirty blocks among a set back to their devices in batches
+
+int lcloud_flushcache( void );
+    // Write every dirty block back to its device
+
+int lcloud_setcachewriter( LcCacheWriter writer );
+    // Set the function used to write dirty blocks to the devices
+
+int lcloud_setcachebatchwriter( LcCacheBatchWriter writer );
+    // Set the function used to write batches of dirty blocks to the devices
+
+int lcloud_setwriteback( int enable, int high, int low, int maxage );
+    // Turn write-back mode on or off and set when dirty blocks are flushed
+
+int lcloud_writebackcache( void );
+    // Check if the cache is in write-back mode
+
+int lcloud_setsnapshot( const char *path, int data );
+    // Save the cache to a file on close and load it on init (NULL turns it off)
+
+int lcloud_warmcache( LcCacheReader reader );
+    // Read the blocks of a loaded snapshot back from the devices
+
 int lcloud_initcache( int maxblocks );
     // Initialze the cache by setting up metadata a cache elements.
 
+int lcloud_cacheblocks( size_t bytes );
+    // Work out how many blocks fit in a memory budget
+
+int lcloud_initcachebytes( size_t bytes );
+    // Initialze the cache sized by a memory budget
+
+int lcloud_initcachepolicy( int maxblocks, LcCachePolicy policy, int tinylfu );
+    // Initialze the cache with a given replacement policy
+
+int lcloud_initcacheshards( int maxblocks, int shards, LcCachePolicy policy, int tinylfu );
+    // Initialze the cache split into a number of independently locked shards
+
+float lcloud_cachemrc( int blocks );
+    // Estimate the LRU hit ratio of a cache of the given size
+
+int lcloud_cachestats( LcCacheStats *stats );
+    // Take a snapshot of the cache counters, adding up every shard
+
 int lcloud_closecache( void );
     // Clean up the cache when program is closing.
 
@@ -0,0 +1,601 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_cachepolicy.c
+//  Description    : This is the implementation of the replacement policies
+//                   (LRU, CLOCK, 2Q) and the W-TinyLFU admission filter used
+//                   by the LionCloud block cache.
+//
+//                   With the filter on, new blocks enter a small LRU
+//                   window.  The block leaving the window only moves into
+//                   the replacement policy's part of the cache if it is at
+//                   least as popular as the block the policy would evict,
+//                   otherwise it is the one evicted.
+//
+//   Author        : Samuel Johnson
+//   Last Modified : 10/16/2026
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <cmpsc311_log.h>
+
+// Project includes
+#include <lcloud_cachepolicy.h>
+
+// Defines
+#define LC_2Q_A1IN 0 // Queue holding blocks seen once
+#define LC_2Q_AM 1 // Queue holding blocks seen again after leaving A1in
+#define LC_SKETCH_ROWS 4 // Rows (hash functions) in the TinyLFU sketch
+#define LC_SKETCH_MAX 15 // Saturation value of a sketch counter
+
+//
+// List helpers
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : list_push
+// Description  : Add a block to the head of a policy list
+//
+// Inputs       : pol - the policy
+//                l - the list
+//                i - index of the block
+// Outputs      : none
+
+static void list_push( cachePolicy *pol, cacheList *l, int i ) {
+    pol->prev[i] = LC_POLICY_NONE;
+    pol->next[i] = l->head;
+
+    if(l->head != LC_POLICY_NONE){
+        pol->prev[l->head] = i;
+    } else {
+        l->tail = i;
+    }
+    l->head = i;
+    l->count ++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : list_remove
+// Description  : Unlink a block from a policy list
+//
+// Inputs       : pol - the policy
+//                l - the list
+//                i - index of the block
+// Outputs      : none
+
+static void list_remove( cachePolicy *pol, cacheList *l, int i ) {
+    if(pol->prev[i] != LC_POLICY_NONE){
+        pol->next[pol->prev[i]] = pol->next[i];
+    } else {
+        l->head = pol->next[i];
+    }
+
+    if(pol->next[i] != LC_POLICY_NONE){
+        pol->prev[pol->next[i]] = pol->prev[i];
+    } else {
+        l->tail = pol->prev[i];
+    }
+    l->count --;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : list_victim
+// Description  : Find the oldest block on a list that may be evicted
+//
+// Inputs       : pol - the policy
+//                l - the list
+//                evictable - says if a block may be evicted now
+//                ctx - passed to evictable
+// Outputs      : index of the block, LC_POLICY_NONE if there is none
+
+static int list_victim( cachePolicy *pol, cacheList *l, LcPolicyEvictable evictable, void *ctx ) {
+    int i = l->tail;
+
+    while(i != LC_POLICY_NONE && !evictable(ctx, i)){
+        i = pol->prev[i];
+    }
+    return( i );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : key_hash
+// Description  : Mix a cache key with a seed
+//
+// Inputs       : key - the (device, sector, block) key
+//                seed - selects one of several independent hashes
+// Outputs      : the hashed value
+
+static uint32_t key_hash( uint64_t key, uint32_t seed ) {
+    key ^= (uint64_t)seed * 0x9e3779b97f4a7c15ULL;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return( (uint32_t)key );
+}
+
+//
+// LRU
+
+static int lru_init( cachePolicy *pol ) {
+    return( 0 );
+}
+
+static void lru_insert( cachePolicy *pol, int i, uint64_t key ) {
+    list_push(pol, &pol->lists[0], i);
+}
+
+static void lru_access( cachePolicy *pol, int i ) {
+    list_remove(pol, &pol->lists[0], i);
+    list_push(pol, &pol->lists[0], i);
+}
+
+static int lru_victim( cachePolicy *pol, LcPolicyEvictable evictable, void *ctx ) {
+    return( list_victim(pol, &pol->lists[0], evictable, ctx) );
+}
+
+static void lru_remove( cachePolicy *pol, int i, uint64_t key ) {
+    list_remove(pol, &pol->lists[0], i);
+}
+
+//
+// CLOCK, the state of a block is its reference bit (-1 when the slot is empty)
+
+static int clock_init( cachePolicy *pol ) {
+    memset(pol->state, -1, pol->nblocks);
+    pol->hand = 0;
+    return( 0 );
+}
+
+static void clock_insert( cachePolicy *pol, int i, uint64_t key ) {
+    pol->state[i] = 0;
+}
+
+static void clock_access( cachePolicy *pol, int i ) {
+    pol->state[i] = 1;
+}
+
+static int clock_victim( cachePolicy *pol, LcPolicyEvictable evictable, void *ctx ) {
+
+    // Sweep the hand, clearing reference bits until an unreferenced block is found
+    for(int n = 0; n < 2*pol->nblocks + 1; n++){
+        int i = pol->hand;
+        pol->hand = (pol->hand + 1) % pol->nblocks;
+
+        if(pol->state[i] == 0 && evictable(ctx, i)){
+            return( i );
+        }
+        if(pol->state[i] == 1){
+            pol->state[i] = 0;
+        }
+    }
+    return( LC_POLICY_NONE );
+}
+
+static void clock_remove( cachePolicy *pol, int i, uint64_t key ) {
+    pol->state[i] = -1;
+}
+
+//
+// 2Q, new blocks enter the A1in FIFO, blocks evicted from A1in are remembered
+// in the A1out ghost ring, and a block reloaded while still a ghost goes to Am.
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_find
+// Description  : Look for a key in the 2Q A1out ghost ring
+//
+// Inputs       : pol - the policy
+//                key - the key to find
+// Outputs      : 1 if the key is a ghost, 0 if not
+
+static int ghost_find( cachePolicy *pol, uint64_t key ) {
+    int s = pol->ghostBuckets[key_hash(key, 0) & pol->ghostMask];
+
+    while(s != LC_POLICY_NONE){
+        if(pol->ghostKeys[s] == key){
+            return( 1 );
+        }
+        s = pol->ghostNext[s];
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_add
+// Description  : Remember an evicted key in the A1out ring, dropping the
+//                oldest ghost when the ring is full
+//
+// Inputs       : pol - the policy
+//                key - the evicted key
+// Outputs      : none
+
+static void ghost_add( cachePolicy *pol, uint64_t key ) {
+    int s, *link;
+
+    if(pol->ghostCount == pol->ghostCap){
+        // Unlink the oldest slot from its chain so it can be reused
+        s = (pol->ghostHead + pol->ghostCap - pol->ghostCount) % pol->ghostCap;
+        link = &pol->ghostBuckets[key_hash(pol->ghostKeys[s], 0) & pol->ghostMask];
+        while(*link != s){
+            link = &pol->ghostNext[*link];
+        }
+        *link = pol->ghostNext[s];
+        pol->ghostCount --;
+    }
+
+    s = pol->ghostHead;
+    pol->ghostHead = (pol->ghostHead + 1) % pol->ghostCap;
+    pol->ghostKeys[s] = key;
+    link = &pol->ghostBuckets[key_hash(key, 0) & pol->ghostMask];
+    pol->ghostNext[s] = *link;
+    *link = s;
+    pol->ghostCount ++;
+}
+
+static int twoq_init( cachePolicy *pol ) {
+    int buckets = 1;
+
+    // Kin of 25% and Kout of 50% of the cache, as suggested for 2Q
+    pol->kin = pol->nblocks/4 > 0 ? pol->nblocks/4 : 1;
+    pol->ghostCap = pol->nblocks/2 > 0 ? pol->nblocks/2 : 1;
+    while(buckets < 2*pol->ghostCap){
+        buckets <<= 1;
+    }
+    pol->ghostMask = buckets - 1;
+    pol->ghostHead = 0;
+    pol->ghostCount = 0;
+
+    pol->ghostKeys = malloc(pol->ghostCap*sizeof(uint64_t));
+    pol->ghostNext = malloc(pol->ghostCap*sizeof(int));
+    pol->ghostBuckets = malloc(buckets*sizeof(int));
+    if(pol->ghostKeys == NULL || pol->ghostNext == NULL || pol->ghostBuckets == NULL){
+        return( -1 );
+    }
+    for(int b = 0; b < buckets; b++){
+        pol->ghostBuckets[b] = LC_POLICY_NONE;
+    }
+    return( 0 );
+}
+
+static void twoq_insert( cachePolicy *pol, int i, uint64_t key ) {
+    pol->state[i] = ghost_find(pol, key) ? LC_2Q_AM : LC_2Q_A1IN;
+    list_push(pol, &pol->lists[(int)pol->state[i]], i);
+}
+
+static void twoq_access( cachePolicy *pol, int i ) {
+    // Hits in A1in are correlated references and do not move the block
+    if(pol->state[i] == LC_2Q_AM){
+        list_remove(pol, &pol->lists[LC_2Q_AM], i);
+        list_push(pol, &pol->lists[LC_2Q_AM], i);
+    }
+}
+
+static int twoq_victim( cachePolicy *pol, LcPolicyEvictable evictable, void *ctx ) {
+    int first = LC_2Q_AM, i;
+
+    if(pol->lists[LC_2Q_A1IN].count > pol->kin || pol->lists[LC_2Q_AM].count == 0){
+        first = LC_2Q_A1IN;
+    }
+
+    // Fall back on the other queue if everything in the preferred one is in use
+    if((i = list_victim(pol, &pol->lists[first], evictable, ctx)) == LC_POLICY_NONE){
+        i = list_victim(pol, &pol->lists[!first], evictable, ctx);
+    }
+    return( i );
+}
+
+static void twoq_remove( cachePolicy *pol, int i, uint64_t key ) {
+    list_remove(pol, &pol->lists[(int)pol->state[i]], i);
+    if(pol->state[i] == LC_2Q_A1IN){
+        ghost_add(pol, key);
+    }
+}
+
+// Table of the policies, indexed by LcCachePolicy
+static const cachePolicyOps policyOps[LC_CACHE_MAXPOLICY] = {
+    { "lru", lru_init, lru_insert, lru_access, lru_victim, lru_remove },
+    { "clock", clock_init, clock_insert, clock_access, clock_victim, clock_remove },
+    { "2q", twoq_init, twoq_insert, twoq_access, twoq_victim, twoq_remove },
+};
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_policy_parse
+// Description  : Parse a policy name such as "lru", "clock", "2q" or
+//                "2q+tinylfu"
+//
+// Inputs       : spec - the policy name
+//                policy - where to put the replacement policy
+//                tinylfu - where to put 1 if the admission filter is on
+// Outputs      : 0 if successful, -1 if the name is unknown
+
+int lcloud_policy_parse( const char *spec, LcCachePolicy *policy, int *tinylfu ) {
+    const char *plus = strchr(spec, '+');
+    size_t len = (plus != NULL) ? (size_t)(plus - spec) : strlen(spec);
+
+    if(plus != NULL && strcmp(plus+1, "tinylfu") != 0){
+        return( -1 );
+    }
+    *tinylfu = (plus != NULL);
+
+    for(int p = 0; p < LC_CACHE_MAXPOLICY; p++){
+        if(strlen(policyOps[p].name) == len && strncmp(spec, policyOps[p].name, len) == 0){
+            *policy = p;
+            return( 0 );
+        }
+    }
+    return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_policy_init
+// Description  : Set up the state of a replacement policy
+//
+// Inputs       : pol - the policy to initialize
+//                policy - which replacement policy to use
+//                tinylfu - 1 to filter admissions with W-TinyLFU
+//                nblocks - number of blocks in the cache
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_policy_init( cachePolicy *pol, LcCachePolicy policy, int tinylfu, int nblocks ) {
+    int width = 1;
+
+    if(policy < 0 || policy >= LC_CACHE_MAXPOLICY){
+        logMessage( LOG_ERROR_LEVEL, "Unknown cache policy [%d].", policy);
+        return( -1 );
+    }
+
+    memset(pol, 0, sizeof(cachePolicy));
+    pol->ops = &policyOps[policy];
+    pol->nblocks = nblocks;
+    pol->lists[0].head = pol->lists[0].tail = LC_POLICY_NONE;
+    pol->lists[1].head = pol->lists[1].tail = LC_POLICY_NONE;
+
+    pol->window.head = pol->window.tail = LC_POLICY_NONE;
+
+    pol->prev = malloc(nblocks*sizeof(int));
+    pol->next = malloc(nblocks*sizeof(int));
+    pol->state = malloc(nblocks);
+    if(pol->prev == NULL || pol->next == NULL || pol->state == NULL){
+        logMessage( LOG_ERROR_LEVEL, "Unable to allocate cache policy state.");
+        lcloud_policy_close(pol);
+        return( -1 );
+    }
+
+    if(tinylfu){
+        // One row counter per cached block rounded up to a power of 2, aged every 10 blocks worth of samples
+        while(width < nblocks){
+            width <<= 1;
+        }
+        pol->sketch = calloc(LC_SKETCH_ROWS, width);
+        pol->inWindow = calloc(nblocks, 1);
+        pol->keys = malloc(nblocks*sizeof(uint64_t));
+        if(pol->sketch == NULL || pol->inWindow == NULL || pol->keys == NULL){
+            logMessage( LOG_ERROR_LEVEL, "Unable to allocate cache admission filter.");
+            lcloud_policy_close(pol);
+            return( -1 );
+        }
+        pol->sketchMask = width - 1;
+        pol->sampleLimit = 10*width;
+        pol->windowSize = nblocks*LC_POLICY_WINDOW/100 > 0 ? nblocks*LC_POLICY_WINDOW/100 : 1;
+    }
+
+    if(pol->ops->init(pol)){
+        logMessage( LOG_ERROR_LEVEL, "Unable to initialize cache policy [%s].", pol->ops->name);
+        lcloud_policy_close(pol);
+        return( -1 );
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_policy_close
+// Description  : Release the state of a replacement policy
+//
+// Inputs       : pol - the policy
+// Outputs      : none
+
+void lcloud_policy_close( cachePolicy *pol ) {
+    free(pol->prev);
+    free(pol->next);
+    free(pol->state);
+    free(pol->ghostKeys);
+    free(pol->ghostNext);
+    free(pol->ghostBuckets);
+    free(pol->sketch);
+    free(pol->inWindow);
+    free(pol->keys);
+    pol->inWindow = NULL;
+    pol->keys = NULL;
+    pol->prev = pol->next = NULL;
+    pol->state = NULL;
+    pol->ghostKeys = NULL;
+    pol->ghostNext = pol->ghostBuckets = NULL;
+    pol->sketch = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sketch_estimate
+// Description  : Estimate how often a key was accessed recently
+//
+// Inputs       : pol - the policy
+//                key - the key
+// Outputs      : the smallest counter for the key
+
+static int sketch_estimate( cachePolicy *pol, uint64_t key ) {
+    int freq = LC_SKETCH_MAX;
+
+    for(int r = 0; r < LC_SKETCH_ROWS; r++){
+        uint8_t c = pol->sketch[r*(pol->sketchMask+1) + (key_hash(key, r+1) & pol->sketchMask)];
+        if(c < freq){
+            freq = c;
+        }
+    }
+    return( freq );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sketch_record
+// Description  : Count a reference to a key in the admission filter
+//
+// Inputs       : pol - the policy
+//                key - the key that was referenced
+// Outputs      : none
+
+static void sketch_record( cachePolicy *pol, uint64_t key ) {
+    int width = pol->sketchMask + 1;
+
+    for(int r = 0; r < LC_SKETCH_ROWS; r++){
+        uint8_t *c = &pol->sketch[r*width + (key_hash(key, r+1) & pol->sketchMask)];
+        if(*c < LC_SKETCH_MAX){
+            (*c) ++;
+        }
+    }
+
+    // Halve every counter periodically so old popularity fades out
+    if(++pol->samples >= pol->sampleLimit){
+        for(int c = 0; c < LC_SKETCH_ROWS*width; c++){
+            pol->sketch[c] >>= 1;
+        }
+        pol->samples /= 2;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : window_promote
+// Description  : Move a block out of the admission window into the
+//                replacement policy's part of the cache
+//
+// Inputs       : pol - the policy
+//                i - index of the block
+// Outputs      : none
+
+static void window_promote( cachePolicy *pol, int i ) {
+    list_remove(pol, &pol->window, i);
+    pol->inWindow[i] = 0;
+    pol->ops->insert(pol, i, pol->keys[i]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_policy_insert
+// Description  : Hand a newly cached block to the policy, with the filter on
+//                it enters the admission window and counts as a reference
+//
+// Inputs       : pol - the policy
+//                i - index of the block
+//                key - the key of the block
+// Outputs      : none
+
+void lcloud_policy_insert( cachePolicy *pol, int i, uint64_t key ) {
+    if(pol->sketch == NULL){
+        pol->ops->insert(pol, i, key);
+        return;
+    }
+
+    sketch_record(pol, key);
+    pol->keys[i] = key;
+    pol->inWindow[i] = 1;
+    list_push(pol, &pol->window, i);
+
+    // While the cache still has free blocks nothing is evicted, so the window just overflows into the policy
+    if(pol->window.count > pol->windowSize){
+        window_promote(pol, pol->window.tail);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_policy_access
+// Description  : Tell the policy a cached block was used
+//
+// Inputs       : pol - the policy
+//                i - index of the block
+// Outputs      : none
+
+void lcloud_policy_access( cachePolicy *pol, int i ) {
+    if(pol->sketch == NULL){
+        pol->ops->access(pol, i);
+        return;
+    }
+
+    sketch_record(pol, pol->keys[i]);
+    if(pol->inWindow[i]){
+        list_remove(pol, &pol->window, i);
+        list_push(pol, &pol->window, i);
+    } else {
+        pol->ops->access(pol, i);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_policy_victim
+// Description  : Pick the block to evict.  With the filter on, once the
+//                window is full its oldest block has to leave it to make
+//                room: it replaces the policy's victim if it is at least as
+//                popular (ties go to the newer block), otherwise it is
+//                evicted itself
+//
+// Inputs       : pol - the policy
+//                evictable - tells if a block may be evicted now
+//                ctx - passed to evictable
+// Outputs      : index of the block to evict, LC_POLICY_NONE if there is none
+
+int lcloud_policy_victim( cachePolicy *pol, LcPolicyEvictable evictable, void *ctx ) {
+    int w = LC_POLICY_NONE, m;
+
+    if(pol->sketch == NULL){
+        return( pol->ops->victim(pol, evictable, ctx) );
+    }
+
+    if(pol->window.count >= pol->windowSize){
+        w = list_victim(pol, &pol->window, evictable, ctx);
+    }
+    m = pol->ops->victim(pol, evictable, ctx);
+
+    if(w == LC_POLICY_NONE){
+        return( (m != LC_POLICY_NONE) ? m : list_victim(pol, &pol->window, evictable, ctx) );
+    }
+    if(m == LC_POLICY_NONE){
+        return( w );
+    }
+    if(sketch_estimate(pol, pol->keys[w]) >= sketch_estimate(pol, pol->keys[m])){
+        window_promote(pol, w);
+        return( m );
+    }
+    return( w );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_policy_remove
+// Description  : Take a block away from the policy, when it is evicted or
+//                dropped from the cache
+//
+// Inputs       : pol - the policy
+//                i - index of the block
+//                key - the key of the block
+// Outputs      : none
+
+void lcloud_policy_remove( cachePolicy *pol, int i, uint64_t key ) {
+    if(pol->sketch != NULL && pol->inWindow[i]){
+        list_remove(pol, &pol->window, i);
+        pol->inWindow[i] = 0;
+        return;
+    }
+    pol->ops->remove(pol, i, key);
+}
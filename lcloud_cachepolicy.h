@@ -0,0 +1,95 @@
+#ifndef LCLOUD_CACHEPOLICY_INCLUDED
+#define LCLOUD_CACHEPOLICY_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_cachepolicy.h
+//  Description    : This is the interface of the replacement policies used
+//                   by the LionCloud block cache.
+//
+//   Author        : Samuel Johnson
+//   Last Modified : 10/16/2026
+//
+
+// Includes
+#include <stdint.h>
+
+// Defines
+#define LC_POLICY_NONE -1 // Null block index used by the policy lists
+#define LC_POLICY_WINDOW 20 // Percent of the cache in the W-TinyLFU admission window
+
+// Type definitions
+typedef int (*LcPolicyEvictable)( void *ctx, int i ); // Returns 0 if a block may not be evicted now
+
+typedef enum {
+    LC_CACHE_LRU   = 0, // Least recently used
+    LC_CACHE_CLOCK = 1, // Second chance (CLOCK)
+    LC_CACHE_2Q    = 2, // Simplified 2Q (A1in FIFO, A1out ghosts, Am LRU)
+    LC_CACHE_MAXPOLICY = 3
+} LcCachePolicy;
+
+typedef struct cacheList {
+    int head; // Most recently inserted block
+    int tail; // Oldest block
+    int count; // Number of blocks on the list
+} cacheList;
+
+typedef struct cachePolicy {
+    const struct cachePolicyOps *ops; // Functions implementing the policy
+    int nblocks; // Number of blocks the policy manages
+    int *prev; // List links, indexed by block
+    int *next;
+    char *state; // Per block state (2Q queue, CLOCK reference bit)
+    cacheList lists[2]; // LRU uses lists[0], 2Q uses both (A1in, Am)
+    int hand; // CLOCK hand
+    int kin; // 2Q target size of A1in
+
+    uint64_t *ghostKeys; // 2Q A1out ring of evicted keys
+    int *ghostNext; // Hash chains over the ring slots
+    int *ghostBuckets;
+    int ghostCap, ghostHead, ghostCount, ghostMask;
+
+    uint8_t *sketch; // TinyLFU count-min sketch (4 rows), NULL if disabled
+    cacheList window; // W-TinyLFU admission window, an LRU every new block enters first
+    int windowSize; // Target number of blocks in the window
+    char *inWindow; // 1 if a block is in the window, 0 if the replacement policy has it
+    uint64_t *keys; // Key of each block, used to compare popularity
+    int sketchMask; // Width of a sketch row minus one
+    int samples; // Accesses recorded since the sketch was last aged
+    int sampleLimit; // Number of samples that triggers aging
+} cachePolicy;
+
+typedef struct cachePolicyOps {
+    const char *name;
+    int (*init)( cachePolicy *pol );
+    void (*insert)( cachePolicy *pol, int i, uint64_t key );
+    void (*access)( cachePolicy *pol, int i );
+    int (*victim)( cachePolicy *pol, LcPolicyEvictable evictable, void *ctx );
+    void (*remove)( cachePolicy *pol, int i, uint64_t key );
+} cachePolicyOps;
+
+//
+// Functional Prototypes
+
+int lcloud_policy_parse( const char *spec, LcCachePolicy *policy, int *tinylfu );
+    // Parse a policy name such as "lru", "clock", "2q" or "2q+tinylfu"
+
+int lcloud_policy_init( cachePolicy *pol, LcCachePolicy policy, int tinylfu, int nblocks );
+    // Set up the state of a replacement policy
+
+void lcloud_policy_close( cachePolicy *pol );
+    // Release the state of a replacement policy
+
+void lcloud_policy_insert( cachePolicy *pol, int i, uint64_t key );
+    // Hand a newly cached block to the policy
+
+void lcloud_policy_access( cachePolicy *pol, int i );
+    // Tell the policy a cached block was used
+
+int lcloud_policy_victim( cachePolicy *pol, LcPolicyEvictable evictable, void *ctx );
+    // Pick the block to evict
+
+void lcloud_policy_remove( cachePolicy *pol, int i, uint64_t key );
+    // Take a block away from the policy
+
+#endif
@@ -12,12 +12,23 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <poll.h>
 
 // Project Include Files
 #include <lcloud_network.h>
@@ -25,16 +36,506 @@
 #include <cmpsc311_util.h>
 #include <lcloud_filesys.h>
 
+// Where a server listens, over TCP or a Unix domain socket
+typedef struct lcEndpoint {
+    int family; // AF_INET or AF_UNIX
+    socklen_t len; // Length of the address in use
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in in;
+        struct sockaddr_un un;
+    } addr;
+} lcEndpoint;
+
+// A connection to the server, framed requests go out of it and responses
+// are parsed out of its receive buffer
+typedef struct lcConnection {
+    pthread_mutex_t lock; // Held while a request is using the connection
+    int fd; // The socket, -1 if not connected
+    lcEndpoint *endpoint; // The server the connection goes to
+    char rxBuf[LC_BUS_RXBUF]; // Bytes received from the server but not yet used
+    size_t rxStart; // First unused byte in rxBuf
+    size_t rxEnd; // End of the received bytes in rxBuf
+    LCloudRegisterFrame txFrames[LC_BUS_PIPELINE_DEPTH]; // Frames of the window being sent
+    struct iovec txIov[2*LC_BUS_PIPELINE_DEPTH]; // Pieces of the window being sent
+} lcConnection;
+
 //Global variables
-//Initialize the socket handle to -1
-int socket_handle = -1;
+lcConnection busConns[LC_BUS_MAXCONNS]; // The connection pool, busChannels channels for each server in turn
+int busChannels; // Number of channels to each server
+int busConnCount; // Number of connections in use, busServers*busChannels
+lcEndpoint busEndpoints[LC_BUS_MAXSERVERS]; // The servers, from LCLOUD_BUS_TOPOLOGY, LCLOUD_BUS_ENDPOINT or the default address
+int busServers; // Number of servers
+int busDeviceServer[LC_BUS_MAXDEVICES]; // Server each device lives on, by device id
+char *busEndpointSpec = NULL; // Endpoint set by client_lcloud_bus_endpoint, overrides the environment
+int busStarted = 0; // 1 once the pool has been set up
+pthread_once_t busOnce = PTHREAD_ONCE_INIT; // Sets the pool up on first use
+LcBusStats busStats; // Counters for every request sent over the bus
+
+// The asynchronous engine, an I/O thread that pipelines submitted transfers
+// over the channels and queues them as they complete
+typedef struct lcEngine {
+    pthread_mutex_t lock; // Protects the queues and counters below
+    pthread_cond_t changed; // Signalled when a request completes
+    pthread_t thread; // The I/O thread
+    int running; // 1 while the I/O thread is running
+    int stop; // 1 to make the I/O thread exit once nothing is outstanding
+    int epfd; // epoll set of the wake up eventfd and the busy channels
+    int evfd; // eventfd used to wake the I/O thread
+    LcBusRequest *subHead, *subTail; // Submitted, not yet seen by the I/O thread
+    LcBusRequest *doneHead, *doneTail; // Completed, not yet reaped
+    int outstanding; // Submitted but not yet completed
+
+    // Only touched by the I/O thread
+    LcBusRequest *pendHead[LC_BUS_MAXCONNS], *pendTail[LC_BUS_MAXCONNS]; // Waiting to be sent, by channel
+    LcBusRequest *flightHead[LC_BUS_MAXCONNS], *flightTail[LC_BUS_MAXCONNS]; // Sent, awaiting a response
+    int flightCount[LC_BUS_MAXCONNS]; // Number of requests in flight, by channel
+    int owned[LC_BUS_MAXCONNS]; // 1 while the I/O thread holds the channel's lock
+} lcEngine;
+
+lcEngine busEngine = { .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER };
+pthread_mutex_t busStatsLock = PTHREAD_MUTEX_INITIALIZER; // Protects busStats
+int busNoDelay = 1; // 1 to turn Nagle off on the socket
+int busQuickAck = 1; // 1 to acknowledge responses right away
+int busSndBuf = 0; // Socket send buffer size, 0 for the system default
+int busRcvBuf = 0; // Socket receive buffer size, 0 for the system default
+int busTuned = 0; // 1 once the tunables have been read from the environment
+int busConnectTimeout = 0; // Longest wait for a connection (ms), 0 for the system default
+int busIoTimeout = LC_BUS_IO_TIMEOUT; // Longest wait for the server to take or answer a request (ms), 0 to wait forever
+int busRetries = LC_BUS_RETRIES; // Reconnects tried before a request fails
+int busBackoff = LC_BUS_BACKOFF; // First delay before reconnecting (ms), doubled for each retry
+unsigned int busJitter; // Seed of the backoff jitter
+int busPowered = 0; // 1 once the devices have been powered on, so a reconnect replays the handshake
+LCloudRegisterFrame busDevInit[LC_BUS_MAXDEVICES]; // The init request of each initialized device, 0 if not
 
 //
 // Functions
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : client_lcloud_bus_request
+// Function     : lcloud_endpoint
+// Description  : Parse a server address, "unix:<path>" for a Unix domain
+//                socket, or "[tcp:]<ip>[:<port>]" for TCP
+//
+// Inputs       : spec - the address
+//                ep - where to put the parsed endpoint
+// Outputs      : 0 if successful, -1 if failure
+
+static int lcloud_endpoint( const char *spec, lcEndpoint *ep ) {
+
+    char host[64];
+    const char *colon;
+    long port = LCLOUD_DEFAULT_PORT;
+    size_t len;
+
+    memset(ep, 0, sizeof(lcEndpoint));
+
+    if(strncmp(spec, "unix:", 5) == 0){
+        spec += 5;
+        len = strlen(spec);
+        if(len == 0 || len >= sizeof(ep->addr.un.sun_path)){
+            logMessage( LOG_ERROR_LEVEL, "Bad Unix socket path [%s].", spec);
+            return( -1 );
+        }
+        ep->family = AF_UNIX;
+        ep->addr.un.sun_family = AF_UNIX;
+        memcpy(ep->addr.un.sun_path, spec, len + 1);
+        ep->len = sizeof(struct sockaddr_un);
+        return( 0 );
+    }
+
+    if(strncmp(spec, "tcp:", 4) == 0){
+        spec += 4;
+    }
+    if((colon = strchr(spec, ':')) != NULL){
+        len = colon - spec;
+        port = strtol(colon + 1, NULL, 10);
+    } else {
+        len = strlen(spec);
+    }
+    if(len >= sizeof(host) || port <= 0 || port > 65535){
+        logMessage( LOG_ERROR_LEVEL, "Bad server address [%s].", spec);
+        return( -1 );
+    }
+    memcpy(host, spec, len);
+    host[len] = '\0';
+
+    ep->family = AF_INET;
+    ep->addr.in.sin_family = AF_INET;
+    ep->addr.in.sin_port = htons((uint16_t)port);
+    if(inet_aton((len > 0) ? host : LCLOUD_DEFAULT_IP, &ep->addr.in.sin_addr) == 0){
+        logMessage( LOG_ERROR_LEVEL, "Bad server address [%s].", spec);
+        return( -1 );
+    }
+    ep->len = sizeof(struct sockaddr_in);
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_topology
+// Description  : Parse a topology map spreading the devices over several
+//                servers, "<endpoint>=<devices>[;<endpoint>=<devices>...]"
+//                where the devices are a list of ids and ranges such as
+//                "0-7,12"; devices that are not listed live on the first
+//                server
+//
+// Inputs       : spec - the map
+// Outputs      : 0 if successful, -1 if failure
+
+static int lcloud_topology( const char *spec ) {
+
+    char entry[160], *devs, *end;
+    const char *next;
+    size_t len;
+    long lo, hi;
+
+    busServers = 0;
+    memset(busDeviceServer, 0, sizeof(busDeviceServer));
+
+    for(; *spec != '\0'; spec = next){
+        if((next = strchr(spec, ';')) != NULL){
+            len = next++ - spec;
+        } else {
+            len = strlen(spec);
+            next = spec + len;
+        }
+        if(len == 0){
+            continue;
+        }
+        if(len >= sizeof(entry) || busServers == LC_BUS_MAXSERVERS){
+            logMessage( LOG_ERROR_LEVEL, "Bad topology map [%s].", spec);
+            return( -1 );
+        }
+        memcpy(entry, spec, len);
+        entry[len] = '\0';
+
+        // Split off the devices, the rest is the endpoint
+        if((devs = strrchr(entry, '=')) != NULL){
+            *devs++ = '\0';
+        }
+        if(lcloud_endpoint(entry, &busEndpoints[busServers])){
+            return( -1 );
+        }
+
+        while(devs != NULL && *devs != '\0'){
+            lo = hi = strtol(devs, &end, 10);
+            if(*end == '-'){
+                hi = strtol(end + 1, &end, 10);
+            }
+            if(end == devs || lo < 0 || hi >= LC_BUS_MAXDEVICES || lo > hi || (*end != ',' && *end != '\0')){
+                logMessage( LOG_ERROR_LEVEL, "Bad device list in topology map [%s].", devs);
+                return( -1 );
+            }
+            for(long d = lo; d <= hi; d++){
+                busDeviceServer[d] = busServers;
+            }
+            devs = (*end == ',') ? end + 1 : end;
+        }
+        busServers ++;
+    }
+    return( (busServers > 0) ? 0 : -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_channels
+// Description  : Set up the connection pool, with the servers taken from
+//                LCLOUD_BUS_TOPOLOGY or else LCLOUD_BUS_ENDPOINT (the
+//                default address if neither is set), and the number of
+//                channels to each from LCLOUD_BUS_CHANNELS (1 if unset)
+//
+// Inputs       : none
+// Outputs      : none
+
+static void lcloud_channels( void ) {
+
+    char *spec = getenv("LCLOUD_BUS_CHANNELS");
+    char *endpoint = (busEndpointSpec != NULL) ? busEndpointSpec : getenv("LCLOUD_BUS_ENDPOINT");
+    char *topology = getenv("LCLOUD_BUS_TOPOLOGY");
+
+    // LCLOUD_BUS_CONNECT_TIMEOUT, LCLOUD_BUS_IO_TIMEOUT (ms), LCLOUD_BUS_RETRIES and LCLOUD_BUS_BACKOFF (ms)
+    if((spec = getenv("LCLOUD_BUS_CONNECT_TIMEOUT")) != NULL){
+        busConnectTimeout = atoi(spec);
+    }
+    if((spec = getenv("LCLOUD_BUS_IO_TIMEOUT")) != NULL){
+        busIoTimeout = atoi(spec);
+    }
+    if((spec = getenv("LCLOUD_BUS_RETRIES")) != NULL){
+        busRetries = atoi(spec);
+    }
+    if((spec = getenv("LCLOUD_BUS_BACKOFF")) != NULL){
+        busBackoff = atoi(spec);
+    }
+    busJitter = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    spec = getenv("LCLOUD_BUS_CHANNELS");
+
+    if(busEndpointSpec != NULL || topology == NULL || lcloud_topology(topology)){
+        memset(busDeviceServer, 0, sizeof(busDeviceServer));
+        busServers = 1;
+        if(endpoint == NULL || lcloud_endpoint(endpoint, &busEndpoints[0])){
+            lcloud_endpoint(LCLOUD_DEFAULT_IP, &busEndpoints[0]);
+        }
+    }
+    busStarted = 1;
+
+    busChannels = (spec != NULL) ? atoi(spec) : 1;
+    if(busChannels < 1){
+        busChannels = 1;
+    } else if(busChannels > LC_BUS_MAXCHANNELS){
+        busChannels = LC_BUS_MAXCHANNELS;
+    }
+
+    busConnCount = busServers*busChannels;
+
+    for(int i = 0; i < LC_BUS_MAXCONNS; i++){
+        pthread_mutex_init(&busConns[i].lock, NULL);
+        busConns[i].fd = -1;
+        busConns[i].endpoint = &busEndpoints[(i/busChannels) % busServers];
+        busConns[i].rxStart = busConns[i].rxEnd = 0;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_channel
+// Description  : Pick the connection a request goes over, transfers and
+//                device inits go to the server of their device id (C1) and
+//                are spread over its channels by it, everything else uses
+//                the first channel of the first server
+//
+// Inputs       : reg - the request registers
+// Outputs      : the connection
+
+static lcConnection * lcloud_channel( LCloudRegisterFrame reg ) {
+
+    uint64_t b0, b1, c0, c1, c2, d0, d1;
+
+    pthread_once(&busOnce, lcloud_channels);
+    extract_lcloud_registers(reg, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+    if(c0 == LC_BLOCK_XFER || c0 == LC_DEVINIT){
+        return( &busConns[busDeviceServer[c1 % LC_BUS_MAXDEVICES]*busChannels + c1 % busChannels] );
+    }
+    return( &busConns[0] );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_tune
+// Description  : Apply the socket tunables to a new connection
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+
+static void lcloud_tune( lcConnection *conn ) {
+
+    char *spec;
+
+    // LCLOUD_BUS_NODELAY, LCLOUD_BUS_QUICKACK, LCLOUD_BUS_SNDBUF and LCLOUD_BUS_RCVBUF override the defaults
+    if(!busTuned){
+        if((spec = getenv("LCLOUD_BUS_NODELAY")) != NULL){
+            busNoDelay = atoi(spec);
+        }
+        if((spec = getenv("LCLOUD_BUS_QUICKACK")) != NULL){
+            busQuickAck = atoi(spec);
+        }
+        if((spec = getenv("LCLOUD_BUS_SNDBUF")) != NULL){
+            busSndBuf = atoi(spec);
+        }
+        if((spec = getenv("LCLOUD_BUS_RCVBUF")) != NULL){
+            busRcvBuf = atoi(spec);
+        }
+        busTuned = 1;
+    }
+
+    if(conn->endpoint->family == AF_INET){
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &busNoDelay, sizeof(busNoDelay));
+    }
+    if(busSndBuf > 0){
+        setsockopt(conn->fd, SOL_SOCKET, SO_SNDBUF, &busSndBuf, sizeof(busSndBuf));
+    }
+    if(busRcvBuf > 0){
+        setsockopt(conn->fd, SOL_SOCKET, SO_RCVBUF, &busRcvBuf, sizeof(busRcvBuf));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_connect
+// Description  : Connect to the lion cloud server if there is no connection
+//
+// Inputs       : conn - the connection
+// Outputs      : 0 if successful, -1 if failure
+
+static int lcloud_connect( lcConnection *conn ) {
+
+    lcEndpoint *ep = conn->endpoint;
+    struct timeval tv;
+    struct pollfd pfd;
+    socklen_t errlen = sizeof(int);
+    int flags, err = 0;
+
+    if(conn->fd != -1){ //If the socket is already open
+        return( 0 );
+    }
+
+    //Create the socket, TCP or Unix domain
+    if((conn->fd = socket(ep->family, SOCK_STREAM, 0)) == -1){
+        logMessage( LOG_ERROR_LEVEL, "Unable to create socket [%s].", strerror(errno));
+        return(-1);
+    }
+    lcloud_tune(conn);
+
+    // Connect with the socket, without blocking if the wait is limited
+    flags = fcntl(conn->fd, F_GETFL);
+    if(busConnectTimeout > 0){
+        fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    while(connect(conn->fd, &ep->addr.sa, ep->len) == -1){
+        if(errno == EINTR){
+            continue;
+        }
+        if(errno == EINPROGRESS){
+            pfd.fd = conn->fd;
+            pfd.events = POLLOUT;
+            if(poll(&pfd, 1, busConnectTimeout) == 1 && getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 && err == 0){
+                break; // Connected
+            }
+            errno = (err != 0) ? err : ETIMEDOUT;
+        }
+        logMessage( LOG_ERROR_LEVEL, "Unable to connect to the server [%s].", strerror(errno));
+        close(conn->fd);
+        conn->fd = -1;
+        return(-1); //Didnt connect properly
+    }
+    fcntl(conn->fd, F_SETFL, flags);
+
+    // Reads and writes that take too long fail like a dropped connection
+    if(busIoTimeout > 0){
+        tv.tv_sec = busIoTimeout/1000;
+        tv.tv_usec = (busIoTimeout%1000)*1000;
+        setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    conn->rxStart = conn->rxEnd = 0;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_disconnect
+// Description  : Close a connection, dropping anything left in its buffer
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+
+static void lcloud_disconnect( lcConnection *conn ) {
+    if(conn->fd != -1){
+        close(conn->fd);
+    }
+    conn->fd = -1;
+    conn->rxStart = conn->rxEnd = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_recv
+// Description  : Copy bytes from the server out of the receive buffer,
+//                refilling it with one large read whenever it runs dry
+//                (partial and interrupted reads are retried)
+//
+// Inputs       : conn - the connection
+//                dst - where to put the bytes
+//                len - number of bytes wanted
+// Outputs      : 0 if successful, -1 if failure (the connection is closed)
+
+static int lcloud_recv( lcConnection *conn, void *dst, size_t len ) {
+
+    char *out = dst;
+    size_t take;
+    ssize_t got;
+
+    while(len > 0){
+        if(conn->rxStart == conn->rxEnd){
+            // Drain whatever the server has sent in one go
+            conn->rxStart = conn->rxEnd = 0;
+            got = read(conn->fd, conn->rxBuf, sizeof(conn->rxBuf));
+            if(got == -1 && errno == EINTR){
+                continue;
+            }
+            if(got <= 0){
+                logMessage( LOG_ERROR_LEVEL, "Network Error [%s].", (got == 0) ? "connection closed" : strerror(errno));
+                lcloud_disconnect(conn);
+                return( -1 );
+            }
+            conn->rxEnd = got;
+
+#ifdef TCP_QUICKACK
+            // Acknowledge straight away so the server's next segment is not held back by Nagle
+            if(busQuickAck && conn->endpoint->family == AF_INET){
+                setsockopt(conn->fd, IPPROTO_TCP, TCP_QUICKACK, &busQuickAck, sizeof(busQuickAck));
+            }
+#endif
+        }
+
+        take = (conn->rxEnd - conn->rxStart < len) ? conn->rxEnd - conn->rxStart : len;
+        memcpy(out, &conn->rxBuf[conn->rxStart], take);
+        conn->rxStart += take;
+        out += take;
+        len -= take;
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_send
+// Description  : Send a run of frames and payloads to the server with
+//                vectored writes, picking up after partial and interrupted
+//                writes
+//
+// Inputs       : conn - the connection
+//                iov - the pieces to send (consumed as they are sent)
+//                cnt - number of pieces
+// Outputs      : 0 if successful, -1 if failure (the connection is closed)
+
+static int lcloud_send( lcConnection *conn, struct iovec *iov, int cnt ) {
+
+    struct msghdr msg;
+    ssize_t sent;
+
+    memset(&msg, 0, sizeof(msg));
+    while(cnt > 0){
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+
+        // MSG_NOSIGNAL turns a dropped connection into an error instead of a SIGPIPE
+        if((sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL)) == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            logMessage( LOG_ERROR_LEVEL, "Network Error [%s].", strerror(errno));
+            lcloud_disconnect(conn);
+            return( -1 ); //Error in the number of bytes written
+        }
+
+        // Skip over what was sent
+        while(cnt > 0 && (size_t)sent >= iov->iov_len){
+            sent -= iov->iov_len;
+            iov ++;
+            cnt --;
+        }
+        if(cnt > 0){
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_bus_transfer
 // Description  : This the client regstateeration that sends a request to the 
 //                lion client server.   It will:
 //
@@ -42,150 +543,1160 @@ int socket_handle = -1;
 //                2) send any request to the server, returning results
 //                3) if CLOSE, will close the connection
 //
-// Inputs       : reg - the request reqisters for the command
+// Inputs       : conn - the connection to use (locked by the caller)
+//                reg - the request reqisters for the command
 //                buf - the block to be read/written from (READ/WRITE)
 // Outputs      : the response structure encoded as needed
 
-LCloudRegisterFrame client_lcloud_bus_request( LCloudRegisterFrame reg, void *buf ) {
+static LCloudRegisterFrame lcloud_bus_transfer( lcConnection *conn, LCloudRegisterFrame reg, void *buf ) {
 
-    struct sockaddr_in caddr;
     LCloudRegisterFrame networkFrame;
     LCloudRegisterFrame resultFrame;
+    struct iovec iov[2];
+    int cnt = 1;
+
+    if(lcloud_connect(conn)){ //If the socket is not open and can not be opened
+        return(-1);
+    }
+
+    // Creates int variables for each of the register components to be used for error checking when extracting the result register
+    uint64_t b0, b1, c0, c1, c2, d0, d1;
+
+    //extract the op code
+    extract_lcloud_registers(reg, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+
+    //Convert to network byte order
+    networkFrame = htonll64(reg);
+
+    //Send the reg, then the buf in the same write if this is a write operation
+    iov[0].iov_base = &networkFrame;
+    iov[0].iov_len = 8;
+    if(c0 == LC_BLOCK_XFER && c2 == LC_XFER_WRITE){
+        iov[1].iov_base = buf;
+        iov[1].iov_len = LC_DEVICE_BLOCK_SIZE;
+        cnt = 2;
+    }
+    if(lcloud_send(conn, iov, cnt)){
+        return(-1);
+    }
+
+    //Recieve the resulting frame and convert it to host order
+    if(lcloud_recv(conn, &resultFrame, 8)){
+        return(-1);
+    }
+    resultFrame = ntohll64(resultFrame);
+
+    //A read operation is followed by the block that was read
+    if(c0 == LC_BLOCK_XFER && c2 == LC_XFER_READ && lcloud_recv(conn, buf, LC_DEVICE_BLOCK_SIZE)){
+        return(-1);
+    }
+
+    if(c0 == LC_POWER_OFF){ //Power off operation
+        //Close the socket, and those of the server's other channels
+        int first = ((conn - busConns)/busChannels)*busChannels;
+        lcloud_disconnect(conn);
+        for(int i = first; i < first + busChannels; i++){
+            if(&busConns[i] != conn){
+                pthread_mutex_lock(&busConns[i].lock);
+                lcloud_disconnect(&busConns[i]);
+                pthread_mutex_unlock(&busConns[i].lock);
+            }
+        }
+    }
+
+    //Return the result frame
+    return(resultFrame);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_bus_account
+// Description  : Count a finished request in the bus statistics
+//
+// Inputs       : reg - the request registers
+//                result - the response (-1 if the request failed)
+//                start - when the request was sent
+// Outputs      : none
+
+static void lcloud_bus_account( LCloudRegisterFrame reg, LCloudRegisterFrame result, struct timespec *start ) {
+
+    struct timespec end;
+    uint64_t b0, b1, c0, c1, c2, d0, d1;
+    long micros;
+    int bucket = 0;
+
+    extract_lcloud_registers(reg, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+    if(c0 >= LC_MAX_OPERATION){
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_mutex_lock(&busStatsLock);
+    busStats.requests[c0] ++;
+    if(result == -1){
+        busStats.errors[c0] ++;
+    }
+
+    // Every request sends and receives a frame, transfers also move a block
+    busStats.bytesSent[c0] += sizeof(LCloudRegisterFrame);
+    busStats.bytesReceived[c0] += sizeof(LCloudRegisterFrame);
+    if(c0 == LC_BLOCK_XFER && c2 == LC_XFER_WRITE){
+        busStats.bytesSent[c0] += LC_DEVICE_BLOCK_SIZE;
+    } else if(c0 == LC_BLOCK_XFER && c2 == LC_XFER_READ){
+        busStats.bytesReceived[c0] += LC_DEVICE_BLOCK_SIZE;
+    }
+
+    micros = (end.tv_sec - start->tv_sec)*1000000L + (end.tv_nsec - start->tv_nsec)/1000;
+    busStats.totalMicros += micros;
+    while((micros >>= 1) > 0 && bucket < LC_BUS_LATENCY_BUCKETS-1){
+        bucket ++;
+    }
+    busStats.latency[bucket] ++;
+    pthread_mutex_unlock(&busStatsLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_engine_complete
+// Description  : Queue a finished asynchronous request to be reaped
+//
+// Inputs       : req - the request
+//                result - its response, -1 if it failed
+// Outputs      : none
+
+static void lcloud_engine_complete( LcBusRequest *req, LCloudRegisterFrame result ) {
+
+    req->result = result;
+    lcloud_bus_account(req->reg, result, &req->start);
 
-    if(socket_handle == -1){ //If the socket is not open
-        //Create the address
-        caddr.sin_family = AF_INET;
-        caddr.sin_port = htons(LCLOUD_DEFAULT_PORT);
-        if(inet_aton(LCLOUD_DEFAULT_IP, &caddr.sin_addr) == 0){
-            return(-1); //Return an error
+    pthread_mutex_lock(&busEngine.lock);
+    req->next = NULL;
+    if(busEngine.doneTail != NULL){
+        busEngine.doneTail->next = req;
+    } else {
+        busEngine.doneHead = req;
+    }
+    busEngine.doneTail = req;
+    busEngine.outstanding --;
+    pthread_cond_broadcast(&busEngine.changed);
+    pthread_mutex_unlock(&busEngine.lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_engine_release
+// Description  : Give a channel back once the I/O thread has nothing on it
+//
+// Inputs       : ch - the channel
+// Outputs      : none
+
+static void lcloud_engine_release( int ch ) {
+
+    if(busEngine.owned[ch] && busEngine.flightCount[ch] == 0 && busEngine.pendHead[ch] == NULL){
+        if(busConns[ch].fd != -1){
+            epoll_ctl(busEngine.epfd, EPOLL_CTL_DEL, busConns[ch].fd, NULL);
+        }
+        busEngine.owned[ch] = 0;
+        pthread_mutex_unlock(&busConns[ch].lock);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_engine_fail
+// Description  : Fail everything queued or in flight on a channel, after its
+//                connection has broken
+//
+// Inputs       : ch - the channel
+// Outputs      : none
+
+static void lcloud_engine_fail( int ch ) {
+
+    LcBusRequest *req;
+
+    if(busConns[ch].fd != -1){
+        epoll_ctl(busEngine.epfd, EPOLL_CTL_DEL, busConns[ch].fd, NULL);
+        lcloud_disconnect(&busConns[ch]);
+    }
+    while((req = busEngine.flightHead[ch]) != NULL){
+        busEngine.flightHead[ch] = req->next;
+        lcloud_engine_complete(req, -1);
+    }
+    while((req = busEngine.pendHead[ch]) != NULL){
+        busEngine.pendHead[ch] = req->next;
+        lcloud_engine_complete(req, -1);
+    }
+    busEngine.flightTail[ch] = busEngine.pendTail[ch] = NULL;
+    busEngine.flightCount[ch] = 0;
+    lcloud_engine_release(ch);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_engine_send
+// Description  : Put as many of a channel's waiting requests in flight as
+//                the pipeline depth allows, in one vectored write
+//
+// Inputs       : ch - the channel
+// Outputs      : 1 if the channel is busy with a synchronous caller, 0 otherwise
+
+static int lcloud_engine_send( int ch ) {
+
+    lcConnection *conn = &busConns[ch];
+    struct epoll_event ev;
+    uint64_t b0, b1, c0, c1, c2, d0, d1;
+    int n = 0, cnt = 0;
+
+    if(busEngine.pendHead[ch] == NULL || busEngine.flightCount[ch] >= LC_BUS_PIPELINE_DEPTH){
+        return( 0 );
+    }
+
+    // Take the channel away from synchronous callers while requests are in flight
+    // on it, never waiting for it (a batch may hold it while waiting on another)
+    if(!busEngine.owned[ch]){
+        if(pthread_mutex_trylock(&conn->lock)){
+            return( 1 );
+        }
+        busEngine.owned[ch] = 1;
+        if(lcloud_connect(conn)){
+            lcloud_engine_fail(ch);
+            return( 0 );
         }
+        ev.events = EPOLLIN;
+        ev.data.u32 = ch;
+        epoll_ctl(busEngine.epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+    }
 
-        //Create the socket
-        socket_handle = socket(PF_INET, SOCK_STREAM, 0);
+    while(busEngine.pendHead[ch] != NULL && busEngine.flightCount[ch] < LC_BUS_PIPELINE_DEPTH){
+        LcBusRequest *req = busEngine.pendHead[ch];
 
-        // Connect with the socket
-        if(connect(socket_handle, (const struct sockaddr *)&caddr, sizeof(caddr)) == -1){
-            return(-1); //Didnt connect properly
+        busEngine.pendHead[ch] = req->next;
+        if(busEngine.pendHead[ch] == NULL){
+            busEngine.pendTail[ch] = NULL;
+        }
+        req->next = NULL;
+        if(busEngine.flightTail[ch] != NULL){
+            busEngine.flightTail[ch]->next = req;
+        } else {
+            busEngine.flightHead[ch] = req;
         }
+        busEngine.flightTail[ch] = req;
+        busEngine.flightCount[ch] ++;
 
+        extract_lcloud_registers(req->reg, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+        clock_gettime(CLOCK_MONOTONIC, &req->start);
+        conn->txFrames[n] = htonll64(req->reg);
+        conn->txIov[cnt].iov_base = &conn->txFrames[n++];
+        conn->txIov[cnt++].iov_len = 8;
+        if(c2 == LC_XFER_WRITE){
+            conn->txIov[cnt].iov_base = req->buf;
+            conn->txIov[cnt++].iov_len = LC_DEVICE_BLOCK_SIZE;
+        }
     }
 
-    // Creates int variables for each of the register components to be used for error checking when extracting the result register
+    if(lcloud_send(conn, conn->txIov, cnt)){
+        lcloud_engine_fail(ch);
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_engine_recv
+// Description  : Read what a channel's connection has, completing every
+//                request whose whole response has arrived
+//
+// Inputs       : ch - the channel
+// Outputs      : none
+
+static void lcloud_engine_recv( int ch ) {
+
+    lcConnection *conn = &busConns[ch];
+    LCloudRegisterFrame result;
+    uint64_t b0, b1, c0, c1, c2, d0, d1;
+    uint64_t rb0, rb1, rc0, rc1, rc2, rd0, rd1;
+    ssize_t got;
+    size_t need;
+
+    // Make room at the end of the buffer
+    if(conn->rxStart > 0){
+        memmove(conn->rxBuf, &conn->rxBuf[conn->rxStart], conn->rxEnd - conn->rxStart);
+        conn->rxEnd -= conn->rxStart;
+        conn->rxStart = 0;
+    }
+
+    got = recv(conn->fd, &conn->rxBuf[conn->rxEnd], sizeof(conn->rxBuf) - conn->rxEnd, MSG_DONTWAIT);
+    if(got == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)){
+        return;
+    }
+    if(got <= 0){
+        logMessage( LOG_ERROR_LEVEL, "Network Error [%s].", (got == 0) ? "connection closed" : strerror(errno));
+        lcloud_engine_fail(ch);
+        return;
+    }
+    conn->rxEnd += got;
+#ifdef TCP_QUICKACK
+    if(busQuickAck && conn->endpoint->family == AF_INET){
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_QUICKACK, &busQuickAck, sizeof(busQuickAck));
+    }
+#endif
+
+    // Responses come back in the order the requests were sent
+    while(busEngine.flightHead[ch] != NULL){
+        LcBusRequest *req = busEngine.flightHead[ch];
+
+        extract_lcloud_registers(req->reg, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+        need = 8 + ((c2 == LC_XFER_READ) ? LC_DEVICE_BLOCK_SIZE : 0);
+        if(conn->rxEnd - conn->rxStart < need){
+            break; // The rest has not arrived yet
+        }
+
+        memcpy(&result, &conn->rxBuf[conn->rxStart], 8);
+        result = ntohll64(result);
+        extract_lcloud_registers(result, &rb0, &rb1, &rc0, &rc1, &rc2, &rd0, &rd1);
+        if(rc0 != c0 || rc1 != c1 || rc2 != c2 || rd0 != d0 || rd1 != d1){
+            logMessage( LOG_ERROR_LEVEL, "Pipelined response does not match its request.");
+            lcloud_engine_fail(ch);
+            return;
+        }
+        if(c2 == LC_XFER_READ){
+            memcpy(req->buf, &conn->rxBuf[conn->rxStart + 8], LC_DEVICE_BLOCK_SIZE);
+        }
+        conn->rxStart += need;
+
+        busEngine.flightHead[ch] = req->next;
+        if(busEngine.flightHead[ch] == NULL){
+            busEngine.flightTail[ch] = NULL;
+        }
+        busEngine.flightCount[ch] --;
+        lcloud_engine_complete(req, result);
+    }
+
+    // Refill the pipeline, or hand the channel back if there is nothing left for it
+    lcloud_engine_send(ch);
+    lcloud_engine_release(ch);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_engine
+// Description  : The I/O thread, it spreads submitted requests over their
+//                channels and waits on epoll for responses
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+static void * lcloud_engine( void *arg ) {
+
+    struct epoll_event events[LC_BUS_MAXCONNS+1];
+    LcBusRequest *sub, *req;
+    uint64_t wakeups;
+    int n, ch, busy, inflight;
+
+    (void)arg;
+    for(;;){
+        // Take the new submissions
+        pthread_mutex_lock(&busEngine.lock);
+        if(busEngine.stop && busEngine.outstanding == 0){
+            pthread_mutex_unlock(&busEngine.lock);
+            break;
+        }
+        sub = busEngine.subHead;
+        busEngine.subHead = busEngine.subTail = NULL;
+        pthread_mutex_unlock(&busEngine.lock);
+
+        while((req = sub) != NULL){
+            sub = req->next;
+            req->next = NULL;
+            ch = lcloud_channel(req->reg) - busConns;
+            if(busEngine.pendTail[ch] != NULL){
+                busEngine.pendTail[ch]->next = req;
+            } else {
+                busEngine.pendHead[ch] = req;
+            }
+            busEngine.pendTail[ch] = req;
+        }
+        busy = 0;
+        for(ch = 0; ch < busConnCount; ch++){
+            busy |= lcloud_engine_send(ch);
+        }
+
+        // Poll again shortly for channels that were busy, otherwise sleep until woken
+        // (or until the I/O timeout, when responses are awaited)
+        inflight = 0;
+        for(ch = 0; ch < busConnCount; ch++){
+            inflight += busEngine.flightCount[ch];
+        }
+        n = epoll_wait(busEngine.epfd, events, LC_BUS_MAXCONNS+1, busy ? 1 : ((inflight > 0 && busIoTimeout > 0) ? busIoTimeout : -1));
+        if(n == 0 && !busy && inflight > 0){
+            logMessage( LOG_ERROR_LEVEL, "Timed out waiting for pipelined responses.");
+            for(ch = 0; ch < busConnCount; ch++){
+                if(busEngine.flightCount[ch] > 0){
+                    lcloud_engine_fail(ch);
+                }
+            }
+        }
+        for(int i = 0; i < n; i++){
+            if(events[i].data.u32 == LC_BUS_MAXCONNS){
+                if(read(busEngine.evfd, &wakeups, sizeof(wakeups)) < 0){
+                    continue; // Nothing to clear
+                }
+            } else if(busEngine.owned[events[i].data.u32]){
+                lcloud_engine_recv(events[i].data.u32);
+            }
+        }
+    }
+    return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_engine_wake
+// Description  : Wake the I/O thread up
+//
+// Inputs       : none
+// Outputs      : none
+
+static void lcloud_engine_wake( void ) {
+    uint64_t one = 1;
+
+    if(write(busEngine.evfd, &one, sizeof(one)) < 0){
+        logMessage( LOG_ERROR_LEVEL, "Unable to wake the bus engine [%s].", strerror(errno));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_engine_start
+// Description  : Start the I/O thread if it is not running (engine lock held)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int lcloud_engine_start( void ) {
+
+    struct epoll_event ev;
+
+    if(busEngine.running){
+        return( 0 );
+    }
+    pthread_once(&busOnce, lcloud_channels);
+
+    busEngine.epfd = epoll_create1(EPOLL_CLOEXEC);
+    busEngine.evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(busEngine.epfd == -1 || busEngine.evfd == -1){
+        logMessage( LOG_ERROR_LEVEL, "Unable to set up the bus engine [%s].", strerror(errno));
+        return( -1 );
+    }
+    ev.events = EPOLLIN;
+    ev.data.u32 = LC_BUS_MAXCONNS;
+    epoll_ctl(busEngine.epfd, EPOLL_CTL_ADD, busEngine.evfd, &ev);
+
+    busEngine.stop = 0;
+    if(pthread_create(&busEngine.thread, NULL, lcloud_engine, NULL)){
+        logMessage( LOG_ERROR_LEVEL, "Unable to start the bus engine thread.");
+        close(busEngine.epfd);
+        close(busEngine.evfd);
+        return( -1 );
+    }
+    busEngine.running = 1;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_engine_stop
+// Description  : Stop the I/O thread once everything submitted has completed
+//
+// Inputs       : none
+// Outputs      : none
+
+static void lcloud_engine_stop( void ) {
+
+    pthread_mutex_lock(&busEngine.lock);
+    if(!busEngine.running){
+        pthread_mutex_unlock(&busEngine.lock);
+        return;
+    }
+    busEngine.stop = 1;
+    lcloud_engine_wake();
+    pthread_mutex_unlock(&busEngine.lock);
+
+    pthread_join(busEngine.thread, NULL);
+    close(busEngine.epfd);
+    close(busEngine.evfd);
+
+    pthread_mutex_lock(&busEngine.lock);
+    busEngine.running = 0;
+    pthread_mutex_unlock(&busEngine.lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_backoff
+// Description  : Sleep before a reconnect, the delay doubles with each
+//                attempt (up to LC_BUS_BACKOFF_MAX) and is jittered so
+//                several clients do not all come back at once
+//
+// Inputs       : attempt - number of reconnects already tried
+// Outputs      : none
+
+static void lcloud_backoff( int attempt ) {
+
+    struct timespec delay;
+    long ms = busBackoff;
+
+    while(attempt-- > 0 && ms < LC_BUS_BACKOFF_MAX){
+        ms *= 2;
+    }
+    if(ms > LC_BUS_BACKOFF_MAX){
+        ms = LC_BUS_BACKOFF_MAX;
+    }
+
+    // Anywhere from half to all of the delay
+    ms = ms/2 + ((ms > 1) ? rand_r(&busJitter) % (ms - ms/2) : 0);
+    delay.tv_sec = ms/1000;
+    delay.tv_nsec = (ms%1000)*1000000L;
+    while(nanosleep(&delay, &delay) == -1 && errno == EINTR);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_replay
+// Description  : Reconnect a broken connection and replay the handshake on
+//                it (power on, probe and the inits of the server's devices)
+//                so the server is in the state the client left it in
+//
+// Inputs       : conn - the connection, locked by the caller
+// Outputs      : 0 if successful, -1 if failure
+
+static int lcloud_replay( lcConnection *conn ) {
+
+    int server = (conn - busConns)/busChannels;
+    LCloudRegisterFrame resultFrame;
+
+    if(lcloud_connect(conn)){
+        return( -1 );
+    }
+
+    pthread_mutex_lock(&busStatsLock);
+    busStats.reconnects ++;
+    pthread_mutex_unlock(&busStatsLock);
+
+    if(!busPowered){
+        return( 0 ); // Nothing to replay yet
+    }
+
+    // A server that kept running refuses the second power on, that is fine as long as it answers
+    if(lcloud_bus_transfer(conn, create_lcloud_registers(0, 0, LC_POWER_ON, 0, 0, 0, 0), NULL) == -1 && conn->fd == -1){
+        return( -1 );
+    }
+    if(lcloud_bus_transfer(conn, create_lcloud_registers(0, 0, LC_DEVPROBE, 0, 0, 0, 0), NULL) == -1){
+        return( -1 );
+    }
+    for(int d = 0; d < LC_BUS_MAXDEVICES; d++){
+        if(busDevInit[d] != 0 && busDeviceServer[d] == server){
+            resultFrame = lcloud_bus_transfer(conn, busDevInit[d], NULL);
+            if(resultFrame == -1){
+                return( -1 );
+            }
+        }
+    }
+    logMessage( LOG_INFO_LEVEL, "Reconnected to server [%d], handshake replayed.", server);
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_bus_retry
+// Description  : Do a request on a connection, reconnecting with backoff and
+//                sending it again if the connection breaks (every request
+//                but power off is safe to repeat: transfers move whole
+//                blocks to fixed places, the rest only set up devices)
+//
+// Inputs       : conn - the connection, locked by the caller
+//                reg - the request registers
+//                buf - the block to be read/written from (READ/WRITE)
+// Outputs      : the response, -1 if failure
+
+static LCloudRegisterFrame lcloud_bus_retry( lcConnection *conn, LCloudRegisterFrame reg, void *buf ) {
+
+    LCloudRegisterFrame resultFrame = lcloud_bus_transfer(conn, reg, buf);
+    uint64_t b0, b1, c0, c1, c2, d0, d1;
+
+    extract_lcloud_registers(reg, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+    for(int attempt = 0; resultFrame == -1 && conn->fd == -1 && c0 != LC_POWER_OFF && attempt < busRetries; attempt++){
+        lcloud_backoff(attempt);
+        pthread_mutex_lock(&busStatsLock);
+        busStats.retries ++;
+        pthread_mutex_unlock(&busStatsLock);
+        if(lcloud_replay(conn) == 0){
+            resultFrame = lcloud_bus_transfer(conn, reg, buf);
+        } else {
+            lcloud_disconnect(conn);
+        }
+    }
+    return( resultFrame );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_handshake
+// Description  : Remember the requests that set the server up, so they can
+//                be replayed after a reconnect
+//
+// Inputs       : reg - the request registers
+//                result - its response
+// Outputs      : none
+
+static void lcloud_handshake( LCloudRegisterFrame reg, LCloudRegisterFrame result ) {
+
     uint64_t b0, b1, c0, c1, c2, d0, d1;
 
-    //extract the op code
     extract_lcloud_registers(reg, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+    if(result == -1){
+        return;
+    }
+    if(c0 == LC_POWER_ON){
+        busPowered = 1;
+    } else if(c0 == LC_POWER_OFF){
+        busPowered = 0;
+        memset(busDevInit, 0, sizeof(busDevInit));
+    } else if(c0 == LC_DEVINIT && c1 < LC_BUS_MAXDEVICES){
+        busDevInit[c1] = reg;
+    }
+}
 
-    if(c0 == LC_BLOCK_XFER && c2 == LC_XFER_READ){ //Case where we are performing a read operation
-        //Convert to network byte order
-        networkFrame = htonll64(reg);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_bus_fanout
+// Description  : Send a request (power on/off, probe) to every server and
+//                merge the responses, a probe reports the devices each
+//                server holds according to the topology map
+//
+// Inputs       : reg - the request registers
+// Outputs      : the merged response, -1 if any server failed
+
+static LCloudRegisterFrame lcloud_bus_fanout( LCloudRegisterFrame reg ) {
+
+    struct timespec start;
+    LCloudRegisterFrame resultFrame, merged = -1;
+    uint64_t b0, b1, c0, c1, c2, d0, d1;
+    uint64_t devices = 0, mask;
+    lcConnection *conn;
+
+    extract_lcloud_registers(reg, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+    for(int s = 0; s < busServers; s++){
+        conn = &busConns[s*busChannels];
+        pthread_mutex_lock(&conn->lock);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        resultFrame = lcloud_bus_retry(conn, reg, NULL);
+        pthread_mutex_unlock(&conn->lock);
+        lcloud_bus_account(reg, resultFrame, &start);
 
-        //Send the reg
-        // write(socket_handle, (char *)&networkFrame, 8);
-        if(write(socket_handle, (char *)&networkFrame, 8) != 8){
-            logMessage( LOG_ERROR_LEVEL, "Network Error.");
-            return(-1); //Error in the number of bytes written
+        if(resultFrame == -1 || extract_lcloud_registers(resultFrame, &b0, &b1, &c0, &c1, &c2, &d0, &d1) || b1 != 1){
+            logMessage( LOG_ERROR_LEVEL, "Server [%d] of the topology failed a request.", s);
+            return( -1 );
         }
 
-        //Read to recieve the resulting frame and convert it to host order
-        //read(socket_handle, (char *)&resultFrame, 8);
-        if(read(socket_handle, (char *)&resultFrame, 8) != 8){
-            logMessage( LOG_ERROR_LEVEL, "Network Error.");
-            return(-1); //Error in the number of bytes read
+        // The probe mask is in the low 16 bits, only take the devices mapped to this server
+        if(c0 == LC_DEVPROBE){
+            mask = 0;
+            for(int d = 0; d < LC_BUS_MAXDEVICES; d++){
+                if(busDeviceServer[d] == s){
+                    mask |= (1 << d);
+                }
+            }
+            devices |= resultFrame & 0xffff & mask;
         }
+        if(s == 0){
+            merged = resultFrame;
+        }
+    }
+
+    if(c0 == LC_DEVPROBE){
+        merged = (merged & ~(LCloudRegisterFrame)0xffff) | devices;
+    }
+    lcloud_handshake(reg, merged);
+    return( merged );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_request
+// Description  : Sends a request to the lion cloud server over the channel
+//                of its device, counting the bytes moved and the time the
+//                request took
+//
+// Inputs       : reg - the request reqisters for the command
+//                buf - the block to be read/written from (READ/WRITE)
+// Outputs      : the response structure encoded as needed
+
+LCloudRegisterFrame client_lcloud_bus_request( LCloudRegisterFrame reg, void *buf ) {
 
-        //Read to get the resulting returned value
-        //read(socket_handle, buf, LC_DEVICE_BLOCK_SIZE);
-        if(read(socket_handle, buf, LC_DEVICE_BLOCK_SIZE) != LC_DEVICE_BLOCK_SIZE){
-            logMessage( LOG_ERROR_LEVEL, "Network Error.");
-            return(-1); //Error in the number of bytes read
+    struct timespec start;
+    LCloudRegisterFrame resultFrame;
+    lcConnection *conn = lcloud_channel(reg);
+    uint64_t b0, b1, c0, c1, c2, d0, d1;
+
+    // Powering off ends the asynchronous engine first, once its requests are done
+    extract_lcloud_registers(reg, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+    if(c0 == LC_POWER_OFF){
+        lcloud_engine_stop();
+    }
+
+    // Requests that are not for one device go to every server
+    if(busServers > 1 && c0 != LC_BLOCK_XFER && c0 != LC_DEVINIT){
+        return( lcloud_bus_fanout(reg) );
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    resultFrame = lcloud_bus_retry(conn, reg, buf);
+    lcloud_handshake(reg, resultFrame);
+    pthread_mutex_unlock(&conn->lock);
+    lcloud_bus_account(reg, resultFrame, &start);
+
+    return( resultFrame );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_batch_send
+// Description  : Send a window of block transfers (with the payloads of the
+//                writes) over a connection in one vectored write
+//
+// Inputs       : conn - the connection
+//                regs - the request registers
+//                bufs - the block of each request
+//                idx - indexes of the requests in the window
+//                n - number of requests in the window
+// Outputs      : 0 if successful, -1 if failure
+
+static int lcloud_batch_send( lcConnection *conn, LCloudRegisterFrame *regs, void **bufs, int *idx, int n ) {
+
+    uint64_t b0, b1, c0, c1, c2, d0, d1;
+    int cnt = 0;
+
+    for(int i = 0; i < n; i++){
+        extract_lcloud_registers(regs[idx[i]], &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+        conn->txFrames[i] = htonll64(regs[idx[i]]);
+        conn->txIov[cnt].iov_base = &conn->txFrames[i];
+        conn->txIov[cnt++].iov_len = 8;
+        if(c2 == LC_XFER_WRITE){
+            conn->txIov[cnt].iov_base = bufs[idx[i]];
+            conn->txIov[cnt++].iov_len = LC_DEVICE_BLOCK_SIZE;
         }
-        resultFrame = ntohll64(resultFrame);
+    }
+    return( lcloud_send(conn, conn->txIov, cnt) );
+}
 
-        
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_batch_recv
+// Description  : Read the responses to a window of block transfers, which
+//                come back in the order the requests were sent
+//
+// Inputs       : conn - the connection
+//                regs - the request registers
+//                bufs - the block of each request
+//                results - where to put the response to each request
+//                idx - indexes of the requests in the window
+//                n - number of requests in the window
+//                start - when the window was sent
+// Outputs      : 0 if successful, -1 if failure
 
-        //Return the result frame
-        return(resultFrame);
+static int lcloud_batch_recv( lcConnection *conn, LCloudRegisterFrame *regs, void **bufs, LCloudRegisterFrame *results,
+    int *idx, int n, struct timespec *start ) {
 
-    } else if(c0 == LC_BLOCK_XFER && c2 == LC_XFER_WRITE){ //Write operation
-        //Convert to network byte order
-        networkFrame = htonll64(reg);
+    uint64_t b0, b1, c0, c1, c2, d0, d1;
+    uint64_t rb0, rb1, rc0, rc1, rc2, rd0, rd1;
 
-        //Send the reg then the buf to be used
-        // write(socket_handle, (char *)&networkFrame, 8);
-        if(write(socket_handle, (char *)&networkFrame, 8) != 8){
-            logMessage( LOG_ERROR_LEVEL, "Network Error.");
-            return(-1); //Error in the number of bytes written
+    for(int i = 0; i < n; i++){
+        int r = idx[i];
+
+        extract_lcloud_registers(regs[r], &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+        if(lcloud_recv(conn, &results[r], 8)){
+            return(-1);
+        }
+        results[r] = ntohll64(results[r]);
+
+        extract_lcloud_registers(results[r], &rb0, &rb1, &rc0, &rc1, &rc2, &rd0, &rd1);
+        if(rc0 != c0 || rc1 != c1 || rc2 != c2 || rd0 != d0 || rd1 != d1){
+            logMessage( LOG_ERROR_LEVEL, "Pipelined response does not match its request.");
+            lcloud_disconnect(conn); // The stream is out of step, start over
+            return(-1);
         }
-        //write(socket_handle, buf, LC_DEVICE_BLOCK_SIZE);
-        if(write(socket_handle, buf, LC_DEVICE_BLOCK_SIZE) != LC_DEVICE_BLOCK_SIZE){
-            logMessage( LOG_ERROR_LEVEL, "Network Error.");
-            return(-1); //Error in the number of bytes written
+        if(c2 == LC_XFER_READ && lcloud_recv(conn, bufs[r], LC_DEVICE_BLOCK_SIZE)){
+            return(-1);
         }
+        lcloud_bus_account(regs[r], results[r], start);
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_bus_batch
+// Description  : Sends a batch of block transfers to the lion cloud server,
+//                split over the channels of their devices.  Each round sends
+//                up to LC_BUS_PIPELINE_DEPTH transfers on every channel before
+//                reading any responses, so the channels are served at the
+//                same time
+//
+// Inputs       : regs - the request registers, all LC_BLOCK_XFER
+//                bufs - the block to be read/written by each request
+//                results - where to put the response to each request
+//                count - number of requests
+// Outputs      : 0 if every request got a response, -1 if failure
+
+static int lcloud_bus_batch( LCloudRegisterFrame *regs, void **bufs, LCloudRegisterFrame *results, int count ) {
+
+    struct timespec start;
+    int first[LC_BUS_MAXCONNS+1] = {0}; // Where each channel's requests start in order
+    int done[LC_BUS_MAXCONNS]; // Requests of each channel finished so far
+    int window[LC_BUS_MAXCONNS]; // Requests of each channel in flight this round
+    int *order, ch, ret = 0, remaining = count;
+
+    // Sort the requests by channel, keeping their order within each channel
+    if((order = malloc(count*sizeof(int))) == NULL){
+        return( -1 );
+    }
+    pthread_once(&busOnce, lcloud_channels);
+    for(int i = 0; i < count; i++){
+        first[(lcloud_channel(regs[i]) - busConns) + 1] ++;
+    }
+    for(ch = 0; ch < busConnCount; ch++){
+        first[ch+1] += first[ch];
+        done[ch] = 0;
+    }
+    for(int i = 0; i < count; i++){
+        ch = lcloud_channel(regs[i]) - busConns;
+        order[first[ch] + done[ch]++] = i;
+    }
 
-        //Read to recieve the resulting frame and convert it to host order
-        // read(socket_handle, (char *)&resultFrame, 8);
-        if(read(socket_handle, (char *)&resultFrame, 8) != 8){
-            logMessage( LOG_ERROR_LEVEL, "Network Error.");
-            return(-1); //Error in the number of bytes read
+    // Take the channels in order so two batches can not deadlock
+    for(ch = 0; ch < busConnCount; ch++){
+        done[ch] = 0;
+        if(first[ch+1] > first[ch]){
+            pthread_mutex_lock(&busConns[ch].lock);
+            if(ret == 0 && lcloud_connect(&busConns[ch])){
+                ret = -1;
+            }
         }
-        resultFrame = ntohll64(resultFrame);
+    }
 
-        //Return the result frame
-        return(resultFrame);
+    while(ret == 0 && remaining > 0){
+        clock_gettime(CLOCK_MONOTONIC, &start);
 
-    } else if(c0 == LC_POWER_OFF){ //Power off operation
-        //Convert to network byte order
-        networkFrame = htonll64(reg);
+        // Put a window in flight on every channel, then collect the responses
+        for(ch = 0; ch < busConnCount && ret == 0; ch++){
+            window[ch] = first[ch+1] - first[ch] - done[ch];
+            if(window[ch] > LC_BUS_PIPELINE_DEPTH){
+                window[ch] = LC_BUS_PIPELINE_DEPTH;
+            }
+            if(window[ch] > 0 && lcloud_batch_send(&busConns[ch], regs, bufs, &order[first[ch] + done[ch]], window[ch])){
+                ret = -1;
+            }
+        }
+        for(ch = 0; ch < busConnCount && ret == 0; ch++){
+            if(window[ch] > 0){
+                if(lcloud_batch_recv(&busConns[ch], regs, bufs, results, &order[first[ch] + done[ch]], window[ch], &start)){
+                    ret = -1;
+                }
+                done[ch] += window[ch];
+                remaining -= window[ch];
+            }
+        }
+    }
 
-        //Send the reg then the buf to be used
-        //write(socket_handle, (char *)&networkFrame, 8);
-        if(write(socket_handle, (char *)&networkFrame, 8) != 8){
-            logMessage( LOG_ERROR_LEVEL, "Network Error.");
-            return(-1); //Error in the number of bytes written
+    for(ch = 0; ch < busConnCount; ch++){
+        if(first[ch+1] > first[ch]){
+            // Responses may still be on their way after a failure, start the channel over
+            if(ret != 0){
+                lcloud_disconnect(&busConns[ch]);
+            }
+            pthread_mutex_unlock(&busConns[ch].lock);
         }
-        
-        //Read to recieve the resulting frame and convert it to host order
-        //read(socket_handle, (char *)&resultFrame, 8);
-        if(read(socket_handle, (char *)&resultFrame, 8) != 8){
-            logMessage( LOG_ERROR_LEVEL, "Network Error.");
-            return(-1); //Error in the number of bytes read
+    }
+    free(order);
+    return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_batch
+// Description  : Send a batch of block transfers, pipelined over the
+//                channels of their devices, sending the whole batch again
+//                (after reconnecting with backoff) if a connection breaks
+//
+// Inputs       : regs - the request registers of the transfers
+//                bufs - the block of each transfer
+//                results - where to put the response of each transfer
+//                count - number of transfers
+// Outputs      : 0 if successful, -1 if failure
+
+int client_lcloud_bus_batch( LCloudRegisterFrame *regs, void **bufs, LCloudRegisterFrame *results, int count ) {
+
+    uint64_t b0, b1, c0, c1, c2, d0, d1;
+    char used[LC_BUS_MAXCONNS] = {0}; // Channels the batch goes over
+    int ret;
+
+    if(count == 0){
+        return( 0 );
+    }
+    pthread_once(&busOnce, lcloud_channels);
+    for(int i = 0; i < count; i++){
+        extract_lcloud_registers(regs[i], &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+        if(c0 != LC_BLOCK_XFER){
+            logMessage( LOG_ERROR_LEVEL, "Only block transfers can be pipelined.");
+            return( -1 );
         }
-        resultFrame = ntohll64(resultFrame);
+        used[lcloud_channel(regs[i]) - busConns] = 1;
+    }
 
-        //Close the socket
-        close(socket_handle);
-        socket_handle = -1;
+    ret = lcloud_bus_batch(regs, bufs, results, count);
+    for(int attempt = 0; ret != 0 && attempt < busRetries; attempt++){
+        lcloud_backoff(attempt);
+        pthread_mutex_lock(&busStatsLock);
+        busStats.retries ++;
+        pthread_mutex_unlock(&busStatsLock);
 
-        //Return the result frame
-        return(resultFrame);
+        // Bring the broken channels back, the batch connects any others itself
+        for(int ch = 0; ch < busConnCount; ch++){
+            if(!used[ch]){
+                continue;
+            }
+            pthread_mutex_lock(&busConns[ch].lock);
+            if(busConns[ch].fd == -1 && busPowered && lcloud_replay(&busConns[ch])){
+                lcloud_disconnect(&busConns[ch]);
+            }
+            pthread_mutex_unlock(&busConns[ch].lock);
+        }
+        ret = lcloud_bus_batch(regs, bufs, results, count);
+    }
+    return( ret );
+}
 
-    } else { //All other operations
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_submit
+// Description  : Hand a block transfer to the asynchronous engine, it is
+//                pipelined on its device's channel by the I/O thread and
+//                queued for client_lcloud_bus_complete when it finishes
+//
+// Inputs       : req - the request (reg and buf filled in, done optional),
+//                      it must stay valid until it is reaped
+// Outputs      : 0 if successful, -1 if failure
 
-        //Convert to network byte order
-        networkFrame = htonll64(reg);
+int client_lcloud_bus_submit( LcBusRequest *req ) {
 
-        // write(socket_handle, (char *)&networkFrame, 8);
+    uint64_t b0, b1, c0, c1, c2, d0, d1;
+
+    extract_lcloud_registers(req->reg, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+    if(c0 != LC_BLOCK_XFER){
+        logMessage( LOG_ERROR_LEVEL, "Only block transfers can be submitted asynchronously.");
+        return( -1 );
+    }
+
+    pthread_mutex_lock(&busEngine.lock);
+    if(lcloud_engine_start()){
+        pthread_mutex_unlock(&busEngine.lock);
+        return( -1 );
+    }
+    req->result = -1;
+    req->next = NULL;
+    if(busEngine.subTail != NULL){
+        busEngine.subTail->next = req;
+    } else {
+        busEngine.subHead = req;
+    }
+    busEngine.subTail = req;
+    busEngine.outstanding ++;
+    lcloud_engine_wake();
+    pthread_mutex_unlock(&busEngine.lock);
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_complete
+// Description  : Reap completed asynchronous requests.  Requests with a done
+//                callback have it called (on this thread), the others are
+//                returned
+//
+// Inputs       : reqs - where to put the completed requests without a callback
+//                max - room in reqs
+//                wait - 1 to wait until something completes (if anything is
+//                       outstanding), 0 to only take what is already done
+// Outputs      : number of requests put in reqs
+
+int client_lcloud_bus_complete( LcBusRequest **reqs, int max, int wait ) {
 
-        // read(socket_handle, (char *)&resultFrame, 8);
+    LcBusRequest *req, *callbacks = NULL, **tail = &callbacks;
+    int n = 0, reaped = 0;
 
-        // Send the reg then the buf to be used
-        if(write(socket_handle, (char *)&networkFrame, 8) != 8){
-            logMessage( LOG_ERROR_LEVEL, "Network Error.");
-            return(-1); //Error in the number of bytes written
+    pthread_mutex_lock(&busEngine.lock);
+    while(wait && busEngine.doneHead == NULL && busEngine.outstanding > 0){
+        pthread_cond_wait(&busEngine.changed, &busEngine.lock);
+    }
+
+    // Take what is done, up to max of the requests that are handed back
+    while((req = busEngine.doneHead) != NULL && (req->done != NULL || n < max)){
+        busEngine.doneHead = req->next;
+        if(req->done != NULL){
+            *tail = req;
+            tail = &req->next;
+        } else {
+            reqs[n++] = req;
         }
-        
-        //Read to recieve the resulting frame and convert it to host order
-        if(read(socket_handle, (char *)&resultFrame, 8) != 8){
-            logMessage( LOG_ERROR_LEVEL, "Network Error.");
-            return(-1); //Error in the number of bytes read
+        reaped ++;
+    }
+    *tail = NULL;
+    if(busEngine.doneHead == NULL){
+        busEngine.doneTail = NULL;
+    }
+    pthread_mutex_unlock(&busEngine.lock);
+
+    // Run the callbacks without holding the engine lock
+    while((req = callbacks) != NULL){
+        callbacks = req->next;
+        req->done(req);
+    }
+    return( n );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_drain
+// Description  : Wait for every outstanding asynchronous request, running the
+//                done callbacks (requests without one stay queued)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int client_lcloud_bus_drain( void ) {
+
+    LcBusRequest *req, **link, *callbacks = NULL, **tail = &callbacks;
+
+    pthread_mutex_lock(&busEngine.lock);
+    while(busEngine.outstanding > 0){
+        pthread_cond_wait(&busEngine.changed, &busEngine.lock);
+    }
+
+    // Pull out the requests with callbacks, keeping the rest in order
+    busEngine.doneTail = NULL;
+    for(link = &busEngine.doneHead; (req = *link) != NULL; ){
+        if(req->done != NULL){
+            *link = req->next;
+            *tail = req;
+            tail = &req->next;
+        } else {
+            busEngine.doneTail = req;
+            link = &req->next;
         }
-        resultFrame = ntohll64(resultFrame);
+    }
+    *tail = NULL;
+    pthread_mutex_unlock(&busEngine.lock);
 
+    while((req = callbacks) != NULL){
+        callbacks = req->next;
+        req->done(req);
+    }
+    return( 0 );
+}
 
-        //Return the result frame
-        return(resultFrame);
-        
-    }   
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_endpoint
+// Description  : Choose the server to connect to, "unix:<path>" for a Unix
+//                domain socket or "[tcp:]<ip>[:<port>]" for TCP, before the
+//                first request is sent
+//
+// Inputs       : spec - the address
+// Outputs      : 0 if successful, -1 if failure
+
+int client_lcloud_bus_endpoint( const char *spec ) {
+
+    lcEndpoint ep;
+
+    if(lcloud_endpoint(spec, &ep)){
+        return( -1 );
+    }
+    if(busStarted){
+        logMessage( LOG_ERROR_LEVEL, "The server can not be changed once the bus is in use.");
+        return( -1 );
+    }
+    free(busEndpointSpec);
+    busEndpointSpec = strdup(spec);
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_timeouts
+// Description  : Set how long to wait for a connection and for the server,
+//                and how hard to try reconnecting when a connection breaks
+//
+// Inputs       : connectms - longest wait for a connection (ms), 0 for the system default
+//                ioms - longest wait for the server to take or answer a request (ms), 0 for no limit
+//                retries - reconnects tried before a request fails
+//                backoffms - delay before the first reconnect (ms), doubled for each retry
+// Outputs      : 0 if successful, -1 if failure
+
+int client_lcloud_bus_timeouts( int connectms, int ioms, int retries, int backoffms ) {
+
+    if(connectms < 0 || ioms < 0 || retries < 0 || backoffms < 0){
+        return( -1 );
+    }
+    pthread_once(&busOnce, lcloud_channels);
+    busConnectTimeout = connectms;
+    busIoTimeout = ioms;
+    busRetries = retries;
+    busBackoff = backoffms;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_tune
+// Description  : Set the socket tunables used by new connections
+//
+// Inputs       : nodelay - 1 to turn Nagle off
+//                quickack - 1 to acknowledge responses right away
+//                sndbuf - socket send buffer size, 0 for the system default
+//                rcvbuf - socket receive buffer size, 0 for the system default
+// Outputs      : 0 if successful, -1 if failure
+
+int client_lcloud_bus_tune( int nodelay, int quickack, int sndbuf, int rcvbuf ) {
+    busNoDelay = (nodelay != 0);
+    busQuickAck = (quickack != 0);
+    busSndBuf = sndbuf;
+    busRcvBuf = rcvbuf;
+    busTuned = 1;
+
+    pthread_once(&busOnce, lcloud_channels);
+    for(int i = 0; i < busConnCount; i++){
+        pthread_mutex_lock(&busConns[i].lock);
+        if(busConns[i].fd != -1){
+            lcloud_tune(&busConns[i]);
+        }
+        pthread_mutex_unlock(&busConns[i].lock);
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_busstats
+// Description  : Take a snapshot of the io bus counters
+//
+// Inputs       : stats - where to put the counters
+// Outputs      : 0 if successful, -1 if failure
 
+int client_lcloud_busstats( LcBusStats *stats ) {
+    pthread_mutex_lock(&busStatsLock);
+    *stats = busStats;
+    pthread_mutex_unlock(&busStatsLock);
+    return( 0 );
 }
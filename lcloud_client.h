@@ -1,3 +1,6 @@
+#ifndef LCLOUD_CLIENT_INCLUDED
+#define LCLOUD_CLIENT_INCLUDED
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  File           : lcloud_client.c
@@ -5,15 +8,77 @@
 //                   assignment for CMPSC311.
 //
 //   Author        : Samuel Johnson
-//   Last Modified : 4/30/2020
+//   Last Modified : 10/16/2026
 //
 
 // Includes 
 #include <stdint.h>
+#include <time.h>
 #include <lcloud_controller.h>
 
+// Defines
+#define LC_BUS_PIPELINE_DEPTH 32 // Most block transfers in flight on the socket at once
+#define LC_BUS_MAXCHANNELS 16 // Most connections to one server
+#define LC_BUS_MAXSERVERS 4 // Most servers the devices can be spread over
+#define LC_BUS_MAXCONNS (LC_BUS_MAXSERVERS*LC_BUS_MAXCHANNELS) // Most connections in the pool
+#define LC_BUS_MAXDEVICES 16 // Device ids are 0 to 15
+#define LC_BUS_RXBUF 65536 // Size of the buffer responses are received into
+#define LC_BUS_LATENCY_BUCKETS 24 // Bucket i counts requests taking [2^i, 2^(i+1)) microseconds
+#define LC_BUS_IO_TIMEOUT 2000 // Longest wait for the server to take or answer a request (ms)
+#define LC_BUS_RETRIES 4 // Reconnects tried before a request fails
+#define LC_BUS_BACKOFF 10 // Delay before the first reconnect (ms), doubled for each retry
+#define LC_BUS_BACKOFF_MAX 1000 // Longest delay between reconnects (ms)
+
+// Type definitions
+typedef struct LcBusStats {
+    long requests[LC_MAX_OPERATION]; // Requests sent, by op code
+    long errors[LC_MAX_OPERATION]; // Requests that failed on the network, by op code
+    long bytesSent[LC_MAX_OPERATION]; // Bytes written to the server, by op code
+    long bytesReceived[LC_MAX_OPERATION]; // Bytes read from the server, by op code
+    long latency[LC_BUS_LATENCY_BUCKETS]; // Log2 histogram of request latency (us)
+    long totalMicros; // Time spent in all requests (us)
+    long reconnects; // Connections re-established after breaking
+    long retries; // Requests (or batches) sent again after a broken connection
+} LcBusStats;
+
+typedef struct LcBusRequest {
+    LCloudRegisterFrame reg; // The request registers (an LC_BLOCK_XFER)
+    void *buf; // The block to read into or write from
+    LCloudRegisterFrame result; // The response, -1 if the request failed
+    void (*done)( struct LcBusRequest *req ); // Called when reaped, NULL to have it returned instead
+    void *ctx; // Left alone, for the submitter
+    struct timespec start; // When the request was sent
+    struct LcBusRequest *next; // Queue link
+} LcBusRequest;
+
 //
 // Functional Prototypes
 
 LCloudRegisterFrame client_lcloud_bus_request( uint64_t reg, void *buf );
-    //Send stuff over the network
\ No newline at end of file
+    //Send stuff over the network
+
+int client_lcloud_bus_batch( LCloudRegisterFrame *regs, void **bufs, LCloudRegisterFrame *results, int count );
+    // Send a batch of block transfers, pipelining them on the socket
+
+int client_lcloud_bus_submit( LcBusRequest *req );
+    // Hand a block transfer to the asynchronous engine
+
+int client_lcloud_bus_complete( LcBusRequest **reqs, int max, int wait );
+    // Reap completed asynchronous transfers
+
+int client_lcloud_bus_drain( void );
+    // Wait for every outstanding asynchronous transfer
+
+int client_lcloud_bus_endpoint( const char *spec );
+    // Choose the server, "unix:<path>" or "[tcp:]<ip>[:<port>]"
+
+int client_lcloud_bus_timeouts( int connectms, int ioms, int retries, int backoffms );
+    // Set the connect and I/O timeouts and the reconnect policy
+
+int client_lcloud_bus_tune( int nodelay, int quickack, int sndbuf, int rcvbuf );
+    // Set the socket tunables (Nagle, quick acks, buffer sizes)
+
+int client_lcloud_busstats( LcBusStats *stats );
+    // Take a snapshot of the io bus counters
+
+#endif
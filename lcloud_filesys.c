@@ -13,12 +13,14 @@
 #include <string.h>
 #include <cmpsc311_log.h>
 #include <math.h>
+#include <pthread.h>
 
 // Project include files
 #include <lcloud_filesys.h>
 #include <lcloud_controller.h>
 #include <lcloud_cache.h>
 #include <lcloud_client.h>
+#include <lcloud_alloc.h>
 
 
 
@@ -43,23 +45,102 @@ typedef struct device {
     int on; // Whether or not the device is on
     int sectors; // Number of sectors in the device
     int blocks; // Number of blocks in the device
-    int *usedBlocks;
+    LcAllocMap usedBlocks; // Free space bitmap, block (sec, blk) is bit sec*blocks + blk
+    uint64_t *zeroBlocks; // Bitmap of the blocks last written with all zeros, which are never sent to the device
 } device;
 
+// A run of file blocks stored one after another in the same sector of a device
+typedef struct extent {
+    int first; // File block the run starts at
+    block start; // Where the first block of the run is stored
+    int length; // Number of blocks in the run
+} extent;
+
 typedef struct file {
-    char name[120]; // String for the name of the file, max size of 20 characters
+    char name[LC_MAX_PATH]; // String for the name of the file
     LcFHandle handle; // Index of the pointer to the file in the file descriptor table
+    int live; // 1 if the slot holds a file, 0 if it is on the free list
+    LcFHandle nameNext; // Next file in the same name index bucket (or in the free list)
     int position;
     int size; // Size of the file in bytes
-    block blocks[10000]; // Array containing all of the blocks where the file is contined, in order of how they are stored
+    extent *extents; // Runs of blocks where the file is contined, in order of how they are stored
+    int extentCount; // Number of runs in extents
+    int extentCap; // Number of runs extents has room for
     int blockCount; // Integer contained the number of blocks this file is stored in
+    int written; // 1 once the file has held a block, so truncating it to nothing does not delete it
     int open; // 1 if open, 0 if closed
+    long cacheHits; // Blocks read out of the cache
+    long cacheMisses; // Blocks read from the devices
+    long bytesRead; // Bytes returned by lcread
+    long bytesWritten; // Bytes accepted by lcwrite
+    int raNext; // Block a sequential read would start in next
+    int raWindow; // Number of blocks to read ahead, 0 when access is random
+    int raDone; // First block that has not been read ahead yet
+    long prefetched; // Blocks read ahead into the cache
 } file;
 
-LcFHandle fileHandleCounter = 0; //Variable containing an int of the current file pointer index
+// A block write waiting to be sent to the device in the next batch
+typedef struct pendingWrite {
+    block loc; // Where the block goes
+    char data[256]; // The data to write
+} pendingWrite;
+
+// A block read on its way from a device, later readers of the same block
+// wait for it instead of sending their own transfer. In practice this is a
+// demand read finding an asynchronous read ahead of its block still on the
+// bus; the rest of the filesystem state (the handle table, the write queue,
+// the zero maps and the free queue) is not locked, so the lc* calls must not
+// be made from more than one thread at a time.
+typedef struct inflightRead {
+    block loc; // The block being read
+    int done; // 1 once the block is in data (and the cache)
+    int async; // 1 if it is a read ahead, which finishes when the bus engine is reaped
+    int status; // 0 if the read worked, -1 if it failed
+    int waiters; // Readers waiting on it, the last one out frees it
+    char data[256]; // The block
+    struct inflightRead *next; // Next read in flight
+} inflightRead;
+
+// A read ahead submitted to the asynchronous bus engine
+typedef struct pendingRead {
+    LcBusRequest req; // The transfer, req.ctx points back here
+    block loc; // Where the block comes from
+    char data[256]; // Where it is read into
+    inflightRead *flight; // Lets demand reads of the block wait for it
+} pendingRead;
+
+LcFHandle fileHandleCounter = 0; // Number of slots of fhTable in use or on the free list
+LcFHandle fileHandleCap = 0; // Number of slots fhTable has room for
+LcFHandle fileFree = -1; // First slot on the free list, the handles of released files
+int fileCount = 0; // Number of files in the name index
+LcFHandle *nameIndex = NULL; // Hash buckets, each holding the handle of the first file in its chain
+int nameMask = -1; // Number of name index buckets minus one (bucket count is a power of 2)
 
 device devOn[16]; //Array containing all of the devices
 
+int readAheadMax = LC_READAHEAD_MAX; // Largest read ahead window, 0 disables read ahead
+int readAheadBatch; // Most blocks read ahead at once, so a batch fits in the cache
+int readAheadAsync = 1; // 1 to read the window beyond a request in the background
+
+int stripeWidth = LC_STRIPE_WIDTH; // Blocks of a file put on one device before moving to the next
+int stripeDevices[16]; // The online devices, in the order files are striped across them
+int stripeCount = 0; // Number of devices in stripeDevices
+
+inflightRead *readsInFlight = NULL; // Block reads that have not finished
+pthread_mutex_t readsLock = PTHREAD_MUTEX_INITIALIZER; // Protects readsInFlight (and only that)
+pthread_cond_t readsDone = PTHREAD_COND_INITIALIZER; // Signalled when a read in flight finishes
+long readsCoalesced = 0; // Reads that waited on another read of the same block
+long writesElided = 0; // Block writes skipped because the cached copy was the same
+long writesZeroed = 0; // All zero block writes kept only in the zero map
+const char zeroBlock[256] = {0}; // A block of zeros to compare with
+
+pendingWrite writeQueue[LC_WRITE_QUEUE]; // Write-through blocks waiting to be sent as one batch
+int writeQueued = 0; // Number of blocks in writeQueue
+
+block freeQueue[LC_FREE_QUEUE]; // Released blocks waiting to be given back to the allocator together
+int freeQueued = 0; // Number of blocks in freeQueue
+long blocksFreed = 0; // Blocks given back to the allocator
+
 //Table containing all of the file handles
 file *fhTable; // Pointer to the start of an array containing the pointers to each file
 
@@ -88,91 +169,1167 @@ LCloudRegisterFrame create_lcloud_registers(uint64_t b0, uint64_t b1, uint64_t c
     return(packedReg); // returns the register frame
 } 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_Block
+// Description  : finds where a block of a file is stored, with a binary
+//                search of the file's extents
+//
+// Inputs       : f - the file
+//                n - the block of the file, counting from 0
+// Outputs      : the location of the block, with all fields -1 if the file
+//                does not have that block
+
+block file_Block( file *f, int n ) {
+
+    block loc = {-1, -1, -1};
+    int lo = 0, hi = f->extentCount - 1, mid;
+
+    if(n < 0 || n >= f->blockCount){
+        return( loc );
+    }
+
+    // Find the last run starting at or before the block
+    while(lo < hi){
+        mid = (lo + hi + 1)/2;
+        if(f->extents[mid].first <= n){
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    loc = f->extents[lo].start;
+    loc.blockNum += n - f->extents[lo].first;
+    return( loc );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_Blocks
+// Description  : copies out the locations of a run of blocks of a file
+//
+// Inputs       : f - the file
+//                n - the first block of the file to copy
+//                count - number of blocks, all of which the file must have
+//                out - where to put the locations
+// Outputs      : 0 if successful, -1 if failure
+
+int file_Blocks( file *f, int n, int count, block *out ) {
+
+    int e, i;
+
+    if(n < 0 || count < 0 || n + count > f->blockCount){
+        logMessage( LOG_ERROR_LEVEL, "Blocks %d-%d are past the end of file [%s].", n, n + count - 1, f->name);
+        return( -1 );
+    }
+    if(count == 0){
+        return( 0 );
+    }
+
+    // Look up the first run, then walk forward through the runs
+    for(e = 0; e < f->extentCount - 1 && f->extents[e+1].first <= n; e++);
+    for(i = 0; i < count; i++, n++){
+        if(n >= f->extents[e].first + f->extents[e].length){
+            e++;
+        }
+        out[i] = f->extents[e].start;
+        out[i].blockNum += n - f->extents[e].first;
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : map_Block
+// Description  : records where a block of a file is stored, growing the last
+//                extent when the block follows it on the device
+//
+// Inputs       : f - the file
+//                n - the block of the file, an existing block or the next one
+//                loc - where the block is stored
+// Outputs      : 0 if successful, -1 if failure
+
+int map_Block( file *f, int n, block loc ) {
+
+    extent *last = (f->extentCount > 0) ? &f->extents[f->extentCount-1] : NULL;
+    extent *grown;
+    block old;
+
+    // Blocks already in the file do not move
+    if(n < f->blockCount){
+        old = file_Block(f, n);
+        if(old.device != loc.device || old.sector != loc.sector || old.blockNum != loc.blockNum){
+            logMessage( LOG_ERROR_LEVEL, "Block %d of file [%s] cannot be moved.", n, f->name);
+            return( -1 );
+        }
+        return( 0 );
+    }
+    if(n > f->blockCount){
+        logMessage( LOG_ERROR_LEVEL, "Block %d of file [%s] leaves a hole.", n, f->name);
+        return( -1 );
+    }
+
+    // The block is stored right after the last run
+    if(last != NULL && last->start.device == loc.device && last->start.sector == loc.sector &&
+        last->start.blockNum + last->length == loc.blockNum){
+        last->length ++;
+        f->blockCount ++;
+        f->written = 1;
+        return( 0 );
+    }
+
+    // Otherwise it starts a new run, doubling the room for runs when it is full
+    if(f->extentCount == f->extentCap){
+        if((grown = realloc(f->extents, (f->extentCap ? f->extentCap*2 : 4)*sizeof(extent))) == NULL){
+            logMessage( LOG_ERROR_LEVEL, "Failure growing the block map of file [%s].", f->name);
+            return( -1 );
+        }
+        f->extents = grown;
+        f->extentCap = f->extentCap ? f->extentCap*2 : 4;
+    }
+    f->extents[f->extentCount].first = n;
+    f->extents[f->extentCount].start = loc;
+    f->extents[f->extentCount].length = 1;
+    f->extentCount ++;
+    f->blockCount ++;
+    f->written = 1;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : extract_lcloud_registers
+// Description  : extract particular registers from a register frame
+//
+// Inputs       : path, then the addresses of ints to store the the register contents into, starting with b0 -> d1
+// Outputs      : a 0 for success, -1 for failure to extract
+
+int extract_lcloud_registers(LCloudRegisterFrame resp, uint64_t*b0, uint64_t*b1, uint64_t*c0, uint64_t*c1, uint64_t*c2, uint64_t*d0, uint64_t*d1) {
+    
+    *b0 = (resp>>60);
+    *b1 = (resp<<4)>>60;
+    *c0 = (resp<<8)>>56;
+    *c1 = (resp<<16)>>56;
+    *c2 = (resp<<24)>>56;
+    *d0 = (resp<<32)>>48;
+    *d1 = (resp<<48)>>48;
+    return( 0 ); // Return 0 for success
+} 
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_Block
+// Description  : writes a block to a device over the io bus, this is also
+//                the function the cache uses to flush dirty blocks
+//
+// Inputs       : did - device to write to
+//                sec - sector to write to
+//                blk - block to write to
+//                buf - the 256 bytes to write
+// Outputs      : 0 if successful, -1 if failure
+
+int write_Block( LcDeviceId did, uint16_t sec, uint16_t blk, char *buf ) {
+
+    // Creates int variables for each of the register components to be used for error checking when extracting the result register
+    uint64_t b0, b1, c0, c1, c2, d0, d1;
+    LCloudRegisterFrame resultFrame;
+
+    /* Do the write operation, check result (From PDM)*/
+    LCloudRegisterFrame instructionFrame = create_lcloud_registers(0, 0, LC_BLOCK_XFER, did, LC_XFER_WRITE, blk, sec);
+    if ( (instructionFrame == -1) || ((resultFrame = client_lcloud_bus_request(instructionFrame, buf)) == -1) ||
+    (extract_lcloud_registers(resultFrame, &b0, &b1, &c0, &c1, &c2, &d0, &d1)) ||
+    (b0 != 1) || (b1 != 1) || (c0 != LC_BLOCK_XFER) ) {
+        return( -1 );
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_Batch
+// Description  : checks the responses of a batch of block transfers
+//
+// Inputs       : results - the response to each transfer
+//                count - number of transfers
+// Outputs      : index of the first failed transfer, -1 if they all worked
+
+int check_Batch( LCloudRegisterFrame *results, int count ) {
+
+    // Creates int variables for each of the register components to be used for error checking when extracting the result register
+    uint64_t b0, b1, c0, c1, c2, d0, d1;
+
+    for(int i = 0; i < count; i++){
+        if( (extract_lcloud_registers(results[i], &b0, &b1, &c0, &c1, &c2, &d0, &d1)) ||
+            (b0 != 1) || (b1 != 1) || (c0 != LC_BLOCK_XFER) ) {
+            return( i );
+        }
+    }
+    return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_Blocks
+// Description  : writes a batch of blocks to the devices as one pipelined
+//                batch, the function the cache uses to write back dirty
+//                blocks in batches
+//
+// Inputs       : keys - where each block goes
+//                bufs - the 256 bytes of each block
+//                count - number of blocks, at most LC_CACHE_FLUSH_BATCH
+// Outputs      : 0 if successful, -1 if failure
+
+int write_Blocks( LcCacheKey *keys, char **bufs, int count ) {
+
+    LCloudRegisterFrame regs[LC_CACHE_FLUSH_BATCH];
+    LCloudRegisterFrame results[LC_CACHE_FLUSH_BATCH];
+
+    if(count > LC_CACHE_FLUSH_BATCH){
+        return( -1 );
+    }
+    for(int i = 0; i < count; i++){
+        regs[i] = create_lcloud_registers(0, 0, LC_BLOCK_XFER, keys[i].device, LC_XFER_WRITE, keys[i].block, keys[i].sector);
+    }
+
+    if(client_lcloud_bus_batch(regs, (void **)bufs, results, count) || check_Batch(results, count) != -1){
+        logMessage( LOG_ERROR_LEVEL, "LC failure writing back a batch of [%d] blocks.", count );
+        return( -1 );
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_Writes
+// Description  : sends every queued write-through block to the devices as one
+//                pipelined batch
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int flush_Writes( void ) {
+
+    LCloudRegisterFrame regs[LC_WRITE_QUEUE];
+    LCloudRegisterFrame results[LC_WRITE_QUEUE];
+    void *bufs[LC_WRITE_QUEUE];
+    int count = writeQueued, failed;
+
+    if(count == 0){
+        return( 0 );
+    }
+    writeQueued = 0;
+
+    for(int i = 0; i < count; i++){
+        regs[i] = create_lcloud_registers(0, 0, LC_BLOCK_XFER, writeQueue[i].loc.device, LC_XFER_WRITE,
+            writeQueue[i].loc.blockNum, writeQueue[i].loc.sector);
+        bufs[i] = writeQueue[i].data;
+    }
+
+    if(client_lcloud_bus_batch(regs, bufs, results, count) || (failed = check_Batch(results, count)) != -1){
+        logMessage( LOG_ERROR_LEVEL, "LC failure writing a batch of [%d] blocks.", count );
+        return( -1 );
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : zero_Block
+// Description  : checks or changes whether a block is in the zero map, the
+//                blocks whose data is all zeros and only kept as metadata
+//
+// Inputs       : did - device of the block
+//                sec - sector of the block
+//                blk - block within the sector
+//                set - 1 to add the block, 0 to remove it, -1 to only check
+// Outputs      : 1 if the block was in the zero map, 0 if not
+
+int zero_Block( LcDeviceId did, uint16_t sec, uint16_t blk, int set ) {
+
+    if(did >= 16 || devOn[did].zeroBlocks == NULL || sec >= devOn[did].sectors || blk >= devOn[did].blocks){
+        return( 0 );
+    }
+
+    int bit = sec*devOn[did].blocks + blk;
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+    int was = (devOn[did].zeroBlocks[bit/64] & mask) != 0;
+
+    if(set == 1){
+        devOn[did].zeroBlocks[bit/64] |= mask;
+    } else if(set == 0){
+        devOn[did].zeroBlocks[bit/64] &= ~mask;
+    }
+    return( was );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unqueue_Write
+// Description  : drops a queued write-through of a block
+//
+// Inputs       : did - device of the block
+//                sec - sector of the block
+//                blk - block within the sector
+// Outputs      : none
+
+void unqueue_Write( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+
+    for(int i = 0; i < writeQueued; i++){
+        if(writeQueue[i].loc.device == did && writeQueue[i].loc.sector == sec && writeQueue[i].loc.blockNum == blk){
+            writeQueue[i] = writeQueue[--writeQueued];
+            return;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : reclaim_Blocks
+// Description  : gives the released blocks back to the allocator in one go,
+//                once the reads ahead in flight have landed, dropping their
+//                queued writes and cached (possibly dirty) copies so nothing
+//                stale is ever sent to or read from them
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int reclaim_Blocks( void ) {
+
+    block *b;
+    int kept = 0;
+
+    // A read ahead of a released block must not land in the cache after it is reused
+    client_lcloud_bus_drain();
+
+    for(int i = 0; i < freeQueued; i++){
+        b = &freeQueue[i];
+        unqueue_Write(b->device, b->sector, b->blockNum);
+
+        // A block pinned by a reader stays queued for the next pass
+        if(lcloud_dropcache(b->device, b->sector, b->blockNum)){
+            freeQueue[kept++] = *b;
+            continue;
+        }
+        zero_Block(b->device, b->sector, b->blockNum, 0);
+        if(lcloud_alloc_free(&devOn[b->device].usedBlocks, b->sector*devOn[b->device].blocks + b->blockNum)){
+            logMessage( LOG_ERROR_LEVEL, "LC failure freeing blkc [%d/%d/%d].", b->device, b->sector, b->blockNum );
+            freeQueued = kept;
+            return( -1 );
+        }
+        blocksFreed ++;
+    }
+    freeQueued = kept;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_Block
+// Description  : queues a block that no file uses any more, to be given back
+//                to the allocator with the next batch
+//
+// Inputs       : loc - the block
+// Outputs      : 0 if successful, -1 if failure
+
+int release_Block( block loc ) {
+
+    // A block the allocator does not have in use, or one still waiting to be given back, was released twice
+    if(!lcloud_alloc_used(&devOn[loc.device].usedBlocks, loc.sector*devOn[loc.device].blocks + loc.blockNum)){
+        logMessage( LOG_ERROR_LEVEL, "LC releasing blkc [%d/%d/%d] that is not in use.", loc.device, loc.sector, loc.blockNum );
+        return( -1 );
+    }
+    for(int i = 0; i < freeQueued; i++){
+        if(freeQueue[i].device == loc.device && freeQueue[i].sector == loc.sector && freeQueue[i].blockNum == loc.blockNum){
+            logMessage( LOG_ERROR_LEVEL, "LC releasing blkc [%d/%d/%d] twice.", loc.device, loc.sector, loc.blockNum );
+            return( -1 );
+        }
+    }
+
+    if(freeQueued == LC_FREE_QUEUE && (reclaim_Blocks() || freeQueued == LC_FREE_QUEUE)){
+        logMessage( LOG_ERROR_LEVEL, "LC failure releasing blkc [%d/%d/%d].", loc.device, loc.sector, loc.blockNum );
+        return( -1 );
+    }
+    freeQueue[freeQueued++] = loc;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : drop_Blocks
+// Description  : cuts a file's block map down to its first blocks, releasing
+//                the rest
+//
+// Inputs       : f - the file
+//                n - number of blocks to keep
+// Outputs      : 0 if successful, -1 if failure
+
+int drop_Blocks( file *f, int n ) {
+
+    extent *e;
+    block loc;
+
+    // Release runs from the end until the run holding the new last block
+    while(f->extentCount > 0 && f->blockCount > n){
+        e = &f->extents[f->extentCount-1];
+        loc = e->start;
+        loc.blockNum += e->length - 1;
+        if(release_Block(loc)){
+            return( -1 );
+        }
+        e->length --;
+        f->blockCount --;
+        if(e->length == 0){
+            f->extentCount --;
+        }
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : take_Block
+// Description  : allocates a free block on a device, marking it as used
+//
+// Inputs       : did - the device
+//                loc - where to put the location of the block
+// Outputs      : 0 if successful, -1 if the device is off or full
+
+int take_Block( int did, block *loc ) {
+
+    int bit;
+
+    // Skip full devices by their count, the bitmap finds a free block near its cursor
+    if(devOn[did].on != 1 || devOn[did].usedBlocks.freeBlocks == 0 || (bit = lcloud_alloc_take(&devOn[did].usedBlocks)) == -1){
+        return( -1 );
+    }
+    loc->sector = bit/devOn[did].blocks;
+    loc->blockNum = bit%devOn[did].blocks;
+    loc->device = did;
+    return( 0 );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : get_Next_Block
-// Description  : returns an avaliable block to write to
+// Description  : allocates an avaliable block to write to. Files are striped
+//                round robin across the online devices, stripeWidth blocks at
+//                a time and starting at a different device for each file, so
+//                large transfers spread over every device; a full device
+//                passes the block on to the next one
 //
-// Inputs       : Nothing
+// Inputs       : f - the file the block is for
+//                n - the block of the file it will be
 // Outputs      : A block containing the locaition of a free block
 
-block get_Next_Block() {
+block get_Next_Block( file *f, int n ) {
 
     // Variables used in function
-    int currentBlock;
-    int currentSector;
     block retBlock;
+    int start;
+
+    // When the devices look full, give back the released blocks and look again
+    for(int pass = 0; pass < 2; pass++){
+        if(pass == 1 && (freeQueued == 0 || reclaim_Blocks())){
+            break;
+        }
+        if(stripeWidth > 0 && stripeCount > 0){
+            start = (int)((f->handle + n/stripeWidth)%stripeCount);
+            for(int i = 0; i < stripeCount; i++){
+                if(!take_Block(stripeDevices[(start + i)%stripeCount], &retBlock)){
+                    return retBlock;
+                }
+            }
+        } else {
+            // Loop through the devices, filling the lowest numbered first
+            for(int i = 0; i < 16; i++){
+                if(!take_Block(i, &retBlock)){
+                    return retBlock;
+                }
+            }
+        }
+    }
+
+    // Returns an error and set the location to -1, -1
+    logMessage( LOG_ERROR_LEVEL, "No avaliable blocks");
+    retBlock.sector = -1;
+    retBlock.blockNum = -1;
+    retBlock.device = -1;
+
+    return retBlock;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : store_Block
+// Description  : stores a block, writing it through to the cache and queueing
+//                it for the device (sent by flush_Writes before lcwrite
+//                returns), or only into the cache when it is in write-back
+//                mode; nothing is sent when the cached copy is already the
+//                same, and an all zero block only goes in the zero map
+//
+// Inputs       : did - device to write to
+//                sec - sector to write to
+//                blk - block to write to
+//                buf - the 256 bytes to write
+// Outputs      : 0 if successful, -1 if failure
+
+int store_Block( LcDeviceId did, uint16_t sec, uint16_t blk, char *buf ) {
+
+    int i;
+
+    // Reads ahead still in flight must land before this block is replaced
+    client_lcloud_bus_drain();
+
+    // A block of zeros is kept as metadata, whatever is on the device (or cached) no longer matters
+    if(memcmp(buf, zeroBlock, 256) == 0 && lcloud_dropcache(did, sec, blk) == 0){
+        unqueue_Write(did, sec, blk);
+        zero_Block(did, sec, blk, 1);
+        writesZeroed ++;
+        return( 0 );
+    }
+
+    // Skip the write if the block already holds this data (a zero block's device copy is stale)
+    if(!zero_Block(did, sec, blk, 0) && lcloud_samecache(did, sec, blk, buf)){
+        writesElided ++;
+        return( 0 );
+    }
+
+    if(lcloud_writebackcache()){
+        return( lcloud_writecache(did, sec, blk, buf) );
+    }
+
+    if(writeQueued == LC_WRITE_QUEUE && flush_Writes()){
+        return( -1 );
+    }
+
+    // A later write to the same block replaces the queued one
+    for(i = 0; i < writeQueued; i++){
+        if(writeQueue[i].loc.device == did && writeQueue[i].loc.sector == sec && writeQueue[i].loc.blockNum == blk){
+            break;
+        }
+    }
+    writeQueue[i].loc.device = did;
+    writeQueue[i].loc.sector = sec;
+    writeQueue[i].loc.blockNum = blk;
+    memcpy(writeQueue[i].data, buf, 256);
+    if(i == writeQueued){
+        writeQueued ++;
+    }
+
+    // Update the cache
+    lcloud_putcache(did, sec, blk, buf);
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_Flight
+// Description  : looks for a read of a block that is in flight (readsLock
+//                held)
+//
+// Inputs       : did - device of the block
+//                sec - sector of the block
+//                blk - block within the sector
+// Outputs      : the read, NULL if the block is not being read
+
+inflightRead * find_Flight( int did, int sec, int blk ) {
+
+    for(inflightRead *fl = readsInFlight; fl != NULL; fl = fl->next){
+        if(fl->loc.device == did && fl->loc.sector == sec && fl->loc.blockNum == blk){
+            return( fl );
+        }
+    }
+    return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : start_Flight
+// Description  : records that a block is being read, so readers that come
+//                along before it finishes can wait for it (readsLock held)
+//
+// Inputs       : did - device of the block
+//                sec - sector of the block
+//                blk - block within the sector
+// Outputs      : the read, NULL if failure
+
+inflightRead * start_Flight( int did, int sec, int blk ) {
+
+    inflightRead *fl = malloc(sizeof(inflightRead));
+
+    if(fl != NULL){
+        fl->loc.device = did;
+        fl->loc.sector = sec;
+        fl->loc.blockNum = blk;
+        fl->done = 0;
+        fl->async = 0;
+        fl->status = -1;
+        fl->waiters = 0;
+        fl->next = readsInFlight;
+        readsInFlight = fl;
+    }
+    return( fl );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : end_Flight
+// Description  : finishes a read in flight, waking up the readers waiting on
+//                it; it is freed here if nobody is waiting
+//
+// Inputs       : fl - the read
+//                status - 0 if the read worked, -1 if it failed
+//                buf - the block read
+// Outputs      : none
+
+void end_Flight( inflightRead *fl, int status, char *buf ) {
+
+    pthread_mutex_lock(&readsLock);
+    for(inflightRead **link = &readsInFlight; *link != NULL; link = &(*link)->next){
+        if(*link == fl){
+            *link = fl->next;
+            break;
+        }
+    }
+    fl->status = status;
+    if(status == 0){
+        memcpy(fl->data, buf, 256);
+    }
+    fl->done = 1;
+    if(fl->waiters == 0){
+        free(fl);
+    } else {
+        pthread_cond_broadcast(&readsDone);
+    }
+    pthread_mutex_unlock(&readsLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wait_Flight
+// Description  : waits for a read in flight to finish, reaping completions
+//                of the asynchronous bus engine since a read ahead only
+//                finishes when it is reaped
+//
+// Inputs       : fl - the read, held by a waiter count
+// Outputs      : none
+
+void wait_Flight( inflightRead *fl ) {
+
+    pthread_mutex_lock(&readsLock);
+    while(!fl->done){
+        if(fl->async){
+            pthread_mutex_unlock(&readsLock);
+            client_lcloud_bus_complete(NULL, 0, 1);
+            pthread_mutex_lock(&readsLock);
+        } else {
+            pthread_cond_wait(&readsDone, &readsLock);
+        }
+    }
+    pthread_mutex_unlock(&readsLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fetch_Block
+// Description  : reads a block from a device over the io bus, this is also
+//                the function the cache uses to warm itself up
+//
+// Inputs       : did - device to read from
+//                sec - sector to read from
+//                blk - block to read from
+//                buf - where to put the 256 bytes
+// Outputs      : 0 if successful, -1 if failure
+
+int fetch_Block( LcDeviceId did, uint16_t sec, uint16_t blk, char *buf ) {
+
+    // Creates int variables for each of the register components to be used for error checking when extracting the result register
+    uint64_t b0, b1, c0, c1, c2, d0, d1;
+    LCloudRegisterFrame resultFrame;
+
+    // Blocks outside of the powered on devices can not be read
+    if(did >= 16 || !devOn[did].on || sec >= devOn[did].sectors || blk >= devOn[did].blocks){
+        return( -1 );
+    }
+
+    // Blocks in the zero map are not read from the device
+    if(zero_Block(did, sec, blk, -1)){
+        memset(buf, 0, 256);
+        return( 0 );
+    }
+
+    // Queued writes have to reach the devices before anything is read back
+    if(flush_Writes()){
+        return( -1 );
+    }
+
+    LCloudRegisterFrame instructionFrame = create_lcloud_registers(0, 0, LC_BLOCK_XFER, did, LC_XFER_READ, blk, sec); //Pack the instruction frame
+    if ( (instructionFrame == -1) || ((resultFrame = client_lcloud_bus_request(instructionFrame, buf)) == -1) ||
+        (extract_lcloud_registers(resultFrame, &b0, &b1, &c0, &c1, &c2, &d0, &d1)) ||
+        (b0 != 1) || (b1 != 1) || (c0 != LC_BLOCK_XFER) ) {
+        logMessage( LOG_ERROR_LEVEL, "Failure to read block [%d/%d/%d].", did, sec, blk);
+        return( -1 );
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_Block
+// Description  : copies part of a block out of the cache, or from the device
+//                (filling the cache) if it is not cached
+//
+// Inputs       : did - device to read from
+//                sec - sector to read from
+//                blk - block to read from
+//                buf - where to put the bytes
+//                off - offset of the first byte wanted within the block
+//                len - number of bytes wanted
+// Outputs      : 1 if the block was cached, 0 if it was read from the device,
+//                -1 if failure
+
+int read_Block( LcDeviceId did, uint16_t sec, uint16_t blk, char *buf, int off, int len ) {
+
+    char buf_256[256]; //256 byte buffer to be used for receiving data from the io bus
+    char *cacheCheck;
+
+    // Blocks in the zero map are all zeros, without a cache or device lookup
+    if(zero_Block(did, sec, blk, -1)){
+        memset(buf, 0, len);
+        return( 1 );
+    }
+
+    cacheCheck = lcloud_pincache(did, sec, blk);
+
+    if(cacheCheck != NULL){ // Check if the desired block is in the cache
+        memcpy(buf, &cacheCheck[off], len); // Copy straight out of the pinned cache block
+        lcloud_unpincache(did, sec, blk);
+        return( 1 );
+    }
+
+    // Wait for the block if a read ahead already has it on the bus, otherwise read it ourselves
+    pthread_mutex_lock(&readsLock);
+    inflightRead *fl = find_Flight(did, sec, blk);
+    if(fl != NULL){
+        fl->waiters ++;
+        readsCoalesced ++;
+        pthread_mutex_unlock(&readsLock);
+        wait_Flight(fl);
+
+        pthread_mutex_lock(&readsLock);
+        int status = fl->status;
+        if(status == 0){
+            memcpy(buf, &fl->data[off], len);
+        }
+        if(--fl->waiters == 0){
+            free(fl);
+        }
+        if(status == 0){
+            pthread_mutex_unlock(&readsLock);
+            return( 0 );
+        }
+        fl = find_Flight(did, sec, blk); // That read failed, try again ourselves
+    }
+    if(fl == NULL){
+        fl = start_Flight(did, sec, blk);
+    } else {
+        fl = NULL; // Someone else started a retry, do not track this one
+    }
+    pthread_mutex_unlock(&readsLock);
+
+    // Read the block from the device
+    if(fetch_Block(did, sec, blk, buf_256)){
+        logMessage( LOG_ERROR_LEVEL, "Failure to read an entire block.");
+        if(fl != NULL){
+            end_Flight(fl, -1, NULL);
+        }
+        return( -1 );
+    }
+
+    // In the case that it is not in the cache, we need to put it into the cache
+    lcloud_putcache(did, sec, blk, buf_256);
+    if(fl != NULL){
+        end_Flight(fl, 0, buf_256);
+    }
+    memcpy(buf, &buf_256[off], len);
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : prefetch_Blocks
+// Description  : reads a run of blocks into the cache ahead of use, skipping
+//                any that are already cached
+//
+// Inputs       : blocks - the blocks to read
+//                count - number of blocks
+// Outputs      : number of blocks read from the devices, -1 if failure
+
+int prefetch_Blocks( block *blocks, int count ) {
+
+    LCloudRegisterFrame *regs = malloc(count*sizeof(LCloudRegisterFrame));
+    LCloudRegisterFrame *results = malloc(count*sizeof(LCloudRegisterFrame));
+    void **bufs = malloc(count*sizeof(void *));
+    char *data = malloc(count*256); // 256 bytes for each block read
+    block **wanted = malloc(count*sizeof(block *));
+    int fetched = 0, failed = -1;
+
+    if(regs == NULL || results == NULL || bufs == NULL || data == NULL || wanted == NULL){
+        fetched = -1;
+    }
+
+    // Only ask for the blocks that are not already cached (possibly dirty) or on their way
+    for(int i = 0; fetched != -1 && i < count; i++){
+        if(zero_Block(blocks[i].device, blocks[i].sector, blocks[i].blockNum, -1) ||
+            lcloud_incache(blocks[i].device, blocks[i].sector, blocks[i].blockNum)){
+            continue;
+        }
+        pthread_mutex_lock(&readsLock);
+        inflightRead *fl = find_Flight(blocks[i].device, blocks[i].sector, blocks[i].blockNum);
+        pthread_mutex_unlock(&readsLock);
+        if(fl != NULL){
+            continue;
+        }
+        regs[fetched] = create_lcloud_registers(0, 0, LC_BLOCK_XFER, blocks[i].device, LC_XFER_READ, blocks[i].blockNum, blocks[i].sector);
+        bufs[fetched] = &data[fetched*256];
+        wanted[fetched] = &blocks[i];
+        fetched ++;
+    }
+
+    // Queued writes have to reach the devices first, then the reads go out in one pipelined batch
+    if(fetched > 0 && (flush_Writes() || client_lcloud_bus_batch(regs, bufs, results, fetched) ||
+        (failed = check_Batch(results, fetched)) != -1)){
+        if(failed != -1){
+            logMessage( LOG_ERROR_LEVEL, "Failure to read ahead block [%d/%d/%d].", wanted[failed]->device, wanted[failed]->sector, wanted[failed]->blockNum);
+        }
+        fetched = -1;
+    }
+
+    for(int i = 0; i < fetched; i++){
+        lcloud_putcache(wanted[i]->device, wanted[i]->sector, wanted[i]->blockNum, bufs[i]);
+    }
+
+    free(regs);
+    free(results);
+    free(bufs);
+    free(data);
+    free(wanted);
+    return( fetched );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : prefetch_Done
+// Description  : puts a block read ahead in the background into the cache,
+//                unless the block was cached meanwhile
+//
+// Inputs       : req - the completed transfer
+// Outputs      : none
+
+void prefetch_Done( LcBusRequest *req ) {
+
+    pendingRead *rd = req->ctx;
+    int failed = (check_Batch(&req->result, 1) != -1);
+
+    if(failed){
+        logMessage( LOG_ERROR_LEVEL, "Failure to read ahead block [%d/%d/%d].", rd->loc.device, rd->loc.sector, rd->loc.blockNum);
+    } else if(!lcloud_incache(rd->loc.device, rd->loc.sector, rd->loc.blockNum)){
+        lcloud_putcache(rd->loc.device, rd->loc.sector, rd->loc.blockNum, rd->data);
+    }
+    if(rd->flight != NULL){
+        end_Flight(rd->flight, failed ? -1 : 0, rd->data);
+    }
+    free(rd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : prefetch_Async
+// Description  : submits reads of a run of blocks to the asynchronous bus
+//                engine, skipping any that are already cached; they reach
+//                the cache when the engine is next drained
+//
+// Inputs       : blocks - the blocks to read
+//                count - number of blocks
+// Outputs      : number of blocks submitted, -1 if failure
+
+int prefetch_Async( block *blocks, int count ) {
+
+    pendingRead *rd;
+    int submitted = 0;
+
+    // Queued writes have to reach the devices before anything is read back
+    if(flush_Writes()){
+        return( -1 );
+    }
+
+    for(int i = 0; i < count; i++){
+        if(zero_Block(blocks[i].device, blocks[i].sector, blocks[i].blockNum, -1) ||
+            lcloud_incache(blocks[i].device, blocks[i].sector, blocks[i].blockNum)){
+            continue;
+        }
+        if((rd = malloc(sizeof(pendingRead))) == NULL){
+            return( -1 );
+        }
+
+        // Skip blocks already on their way, and let demand reads wait for this one
+        pthread_mutex_lock(&readsLock);
+        if(find_Flight(blocks[i].device, blocks[i].sector, blocks[i].blockNum) != NULL){
+            pthread_mutex_unlock(&readsLock);
+            free(rd);
+            continue;
+        }
+        if((rd->flight = start_Flight(blocks[i].device, blocks[i].sector, blocks[i].blockNum)) != NULL){
+            rd->flight->async = 1;
+        }
+        pthread_mutex_unlock(&readsLock);
+
+        rd->loc = blocks[i];
+        rd->req.reg = create_lcloud_registers(0, 0, LC_BLOCK_XFER, blocks[i].device, LC_XFER_READ, blocks[i].blockNum, blocks[i].sector);
+        rd->req.buf = rd->data;
+        rd->req.done = prefetch_Done;
+        rd->req.ctx = rd;
+        if(client_lcloud_bus_submit(&rd->req)){
+            if(rd->flight != NULL){
+                end_Flight(rd->flight, -1, NULL);
+            }
+            free(rd);
+            return( -1 );
+        }
+        submitted ++;
+    }
+    return( submitted );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_Ahead
+// Description  : works out if a read continues a sequential scan of the file,
+//                growing the read ahead window if it does and collapsing it if
+//                it does not, then reads the blocks of the request into the
+//                cache in one batch and the rest of the window in the
+//                background
+//
+// Inputs       : fh - file handle of the file being read
+//                len - the length of the read
+// Outputs      : 0 if successful, -1 if failure
 
-    // Loop through the devices
-    for(int i = 0; i < 16; i++){
+int read_Ahead( LcFHandle fh, size_t len ) {
 
-        //Reset the value for block and sector
-        currentBlock = 0;
-        currentSector = 0;
+    file *f = &fhTable[fh];
+    int fileBlocks = (f->size + 255)/256; // Number of blocks holding file data
+    int first = f->position/256; // Block the read starts in
+    int last; // Last block to read ahead
+    int split; // First block read in the background
+    int fetched = 0, submitted = 0;
+    block *run; // Locations of the blocks to read ahead
 
-        // Make sure we are only looping through online devices
-        if(devOn[i].on == 1){
+    // Let the blocks read ahead that have arrived into the cache, reads of
+    // the others wait for them as they need them
+    client_lcloud_bus_complete(NULL, 0, 0);
+
+    if(readAheadMax == 0 || len == 0 || f->position >= f->size){
+        return( 0 );
+    }
+
+    // A read starting where the last one stopped (or in the same block) is sequential
+    if(first == f->raNext || first == f->raNext - 1){
+        f->raWindow = (f->raWindow == 0) ? LC_READAHEAD_MIN : f->raWindow*2;
+        if(f->raWindow > readAheadMax){
+            f->raWindow = readAheadMax;
+        }
+    } else {
+        f->raWindow = 0;
+        f->raDone = 0;
+    }
+    f->raNext = (int)((f->position + len - 1)/256) + 1;
+
+    if(f->raWindow == 0){
+        return( 0 );
+    }
+
+    // Only read ahead again once less than half of the window is left
+    last = f->raNext - 1 + f->raWindow;
+    if(f->raDone > f->raNext - 1 + f->raWindow/2){
+        return( 0 );
+    }
+    if(f->raDone > first){
+        first = f->raDone;
+    }
+    if(last >= fileBlocks){
+        last = fileBlocks - 1;
+    }
+    if(last - first + 1 > readAheadBatch){
+        last = first + readAheadBatch - 1;
+    }
+    if(last < first){
+        return( 0 );
+    }
+
+    // The blocks of this read are needed now, the rest can arrive while the caller works
+    split = readAheadAsync ? f->raNext : last + 1;
+    if(split < first){
+        split = first;
+    } else if(split > last + 1){
+        split = last + 1;
+    }
+    if((run = malloc((last - first + 1)*sizeof(block))) == NULL || file_Blocks(f, first, last - first + 1, run)){
+        free(run);
+        return( -1 );
+    }
+    if((split > first && (fetched = prefetch_Blocks(run, split - first)) == -1) ||
+        (last >= split && (submitted = prefetch_Async(&run[split - first], last - split + 1)) == -1)){
+        free(run);
+        return( -1 );
+    }
+    free(run);
+    f->prefetched += fetched + submitted;
+    f->raDone = last + 1;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : name_Hash
+// Description  : Hash a file name (FNV-1a) for the name index
+//
+// Inputs       : path - the file name
+// Outputs      : the hash
+
+uint32_t name_Hash( const char *path ) {
+    uint32_t key = 2166136261u;
+
+    while(*path){
+        key ^= (unsigned char)*path++;
+        key *= 16777619u;
+    }
+    return( key );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_File
+// Description  : Look up a file by name in the name index
+//
+// Inputs       : path - the file name
+// Outputs      : the file handle, -1 if there is no such file
+
+LcFHandle find_File( const char *path ) {
+
+    if(nameIndex == NULL){
+        return( -1 );
+    }
+
+    LcFHandle fh = nameIndex[name_Hash(path) & nameMask];
+    while(fh != -1 && strcmp(fhTable[fh].name, path) != 0){
+        fh = fhTable[fh].nameNext;
+    }
+    return( fh );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : index_File
+// Description  : Add a file to the name index, doubling the buckets and
+//                rehashing when there are more files than buckets
+//
+// Inputs       : fh - the file handle of the file
+// Outputs      : 0 if successful, -1 if failure
+
+int index_File( LcFHandle fh ) {
+
+    LcFHandle *buckets;
+    int count = (nameIndex == NULL) ? LC_FILE_BUCKETS : (nameMask + 1)*2;
+    LcFHandle *link;
+
+    if(nameIndex == NULL || fileCount >= nameMask + 1){
+        if((buckets = malloc(count*sizeof(LcFHandle))) == NULL){
+            logMessage( LOG_ERROR_LEVEL, "Failure growing the file name index.");
+            return( -1 );
+        }
+        for(int i = 0; i < count; i++){
+            buckets[i] = -1;
+        }
+        free(nameIndex);
+        nameIndex = buckets;
+        nameMask = count - 1;
+
+        // Put the files already indexed into the new buckets
+        for(LcFHandle i = 0; i < fileHandleCounter; i++){
+            if(fhTable[i].live && i != fh){
+                link = &nameIndex[name_Hash(fhTable[i].name) & nameMask];
+                fhTable[i].nameNext = *link;
+                *link = i;
+            }
+        }
+    }
 
-            // Inefficient way of finding a new block, but works nonetheless.
-            while(*(devOn[i].usedBlocks + currentSector*devOn[i].blocks + currentBlock) == 1){
-               
+    link = &nameIndex[name_Hash(fhTable[fh].name) & nameMask];
+    fhTable[fh].nameNext = *link;
+    *link = fh;
+    fileCount ++;
+    return( 0 );
+}
 
-                if(currentSector == (devOn[i].sectors - 1) && currentBlock == (devOn[i].blocks - 1)){ // All the block are filled
-                            break;
-                        }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : new_File
+// Description  : Find a slot in the file handle table for a new file, reusing
+//                a released handle if there is one and otherwise doubling the
+//                table when it is full
+//
+// Inputs       : none
+// Outputs      : the file handle, -1 if failure
 
-                if(currentBlock != (devOn[i].blocks - 1)){ // Increments the value for block until its at the max
-                    currentBlock ++;
-                } else if(currentSector != devOn[i].sectors - 1){ // Increments the sector and resets the block to 0 
-                    //logMessage( LOG_ERROR_LEVEL, "Sector: %d, Block: %d", sector, currentBlock);
-                    currentBlock = 0;
-                    currentSector ++;
-                }
-            }
+LcFHandle new_File( void ) {
 
-            //logMessage( LOG_ERROR_LEVEL, "If: %d, Block: %d, Sector: %d", devOn[i].usedBlocks[currentSector][currentBlock], currentBlock, currentSector);
+    LcFHandle fh;
+    file *grown;
 
-            //When the loop breaks we return the block containing the next location
-            retBlock.blockNum = currentBlock;
-            retBlock.sector = currentSector;
-            retBlock.device = i;
+    if(fileFree != -1){
+        fh = fileFree;
+        fileFree = fhTable[fh].nameNext;
+        return( fh );
+    }
 
-            if(!(currentSector == (devOn[i].sectors - 1) && currentBlock == (devOn[i].blocks - 1))){ // All the block are filled
-                return retBlock; // Return the block only if we are not full, else we iterate the for loop                
-            }
+    if(fileHandleCounter == fileHandleCap){
+        if((grown = realloc(fhTable, (fileHandleCap ? fileHandleCap*2 : LC_FILE_BUCKETS)*sizeof(file))) == NULL){
+            logMessage( LOG_ERROR_LEVEL, "Failure growing the file handle table.");
+            return( -1 );
         }
-
-        
+        fhTable = grown;
+        fileHandleCap = fileHandleCap ? fileHandleCap*2 : LC_FILE_BUCKETS;
     }
-
-    // Returns an error and set the location to -1, -1
-    logMessage( LOG_ERROR_LEVEL, "No avaliable blocks");
-    retBlock.sector = -1;
-    retBlock.blockNum = -1;
-    retBlock.device = -1;
-
-    return retBlock;
+    return( fileHandleCounter++ );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : extract_lcloud_registers
-// Description  : extract particular registers from a register frame
+// Function     : release_File
+// Description  : Drop a closed file from the name index and put its handle
+//                on the free list to be reused
 //
-// Inputs       : path, then the addresses of ints to store the the register contents into, starting with b0 -> d1
-// Outputs      : a 0 for success, -1 for failure to extract
+// Inputs       : fh - the file handle of the file
+// Outputs      : none
 
-int extract_lcloud_registers(LCloudRegisterFrame resp, uint64_t*b0, uint64_t*b1, uint64_t*c0, uint64_t*c1, uint64_t*c2, uint64_t*d0, uint64_t*d1) {
-    
-    *b0 = (resp>>60);
-    *b1 = (resp<<4)>>60;
-    *c0 = (resp<<8)>>56;
-    *c1 = (resp<<16)>>56;
-    *c2 = (resp<<24)>>56;
-    *d0 = (resp<<32)>>48;
-    *d1 = (resp<<48)>>48;
-    return( 0 ); // Return 0 for success
-} 
+void release_File( LcFHandle fh ) {
+
+    LcFHandle *link = &nameIndex[name_Hash(fhTable[fh].name) & nameMask];
+
+    while(*link != fh){
+        link = &fhTable[*link].nameNext;
+    }
+    *link = fhTable[fh].nameNext;
+    fileCount --;
+
+    free(fhTable[fh].extents);
+    fhTable[fh].extents = NULL;
+    fhTable[fh].live = 0;
+    fhTable[fh].open = 0;
+    fhTable[fh].nameNext = fileFree;
+    fileFree = fh;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -193,6 +1350,28 @@ LcFHandle lcopen( const char *path ) {
     if(firstOpen){
 
         lcloud_initcache(LC_CACHE_MAXBLOCKS); // Initiate the cache
+        lcloud_setcachewriter(write_Block); // Let the cache write back dirty blocks
+        lcloud_setcachebatchwriter(write_Blocks);
+
+        // Size the read ahead window, keeping a batch to half the cache
+        LcCacheStats cacheStats;
+        char *readAhead = getenv("LCLOUD_READAHEAD");
+        if(readAhead != NULL){
+            readAheadMax = atoi(readAhead);
+        }
+        readAhead = getenv("LCLOUD_READAHEAD_ASYNC");
+        if(readAhead != NULL){
+            readAheadAsync = atoi(readAhead);
+        }
+        char *stripe = getenv("LCLOUD_STRIPE_WIDTH");
+        if(stripe != NULL){
+            stripeWidth = atoi(stripe);
+        }
+        lcloud_cachestats(&cacheStats);
+        readAheadBatch = cacheStats.blocks/2;
+        if(readAheadMax > readAheadBatch){
+            readAheadMax = readAheadBatch;
+        }
 
         //Pack the registers with the command to turn on the device
         LCloudRegisterFrame instructionFrame = create_lcloud_registers(0, 0, LC_POWER_ON, 0, 0, 0, 0);
@@ -250,16 +1429,14 @@ LcFHandle lcopen( const char *path ) {
                 devOn[i].sectors = d0;
                 devOn[i].blocks = d1;
 
-                // Allocate memory for the usedBlocks array and set the values to 0s
-                devOn[i].usedBlocks = (int *)malloc(devOn[i].sectors*devOn[i].blocks*sizeof(int));
-
-                // Make sure that all of the values start out as 0
-                for(int k = 0; k < d0; k++){
-                    for (int j = 0; j < d1; j++) {
-                        *(devOn[i].usedBlocks + k*d1 + j) = 0;
-                    }
+                // Every block of the device starts out free
+                if(lcloud_alloc_init(&devOn[i].usedBlocks, devOn[i].sectors*devOn[i].blocks)){
+                    return( -1 );
                 }
 
+                // No block starts out in the zero map
+                devOn[i].zeroBlocks = calloc((d0*d1 + 63)/64, sizeof(uint64_t));
+
 
             } else { 
                 devOn[i].on = 0;
@@ -271,31 +1448,78 @@ LcFHandle lcopen( const char *path ) {
             //logMessage( LOG_ERROR_LEVEL, "Did open work2? sector = %d, block = %d, on = %d, device = %d.", devOn[i].sectors, devOn[i].blocks, devOn[i].on, i);            
         }
 
+        // Stripe files across every device the probe found
+        for(int i = 0; i < 16; i++){
+            if(devOn[i].on == 1){
+                stripeDevices[stripeCount++] = i;
+            }
+        }
+
+        // Read back the blocks a cache snapshot says were in use before the last shutdown
+        lcloud_warmcache(fetch_Block);
+
         //Set the first open variable to 0
         firstOpen = 0;
     }
 
+    if(strlen(path) >= LC_MAX_PATH){
+        logMessage( LOG_ERROR_LEVEL, "The file name [%.20s...] is too long.", path);
+        return( -1 );
+    }
+
+    // A file that already exists is opened again with its contents, from the start
+    LcFHandle fh = find_File(path);
+    if(fh != -1){
+        if(fhTable[fh].open == 0){
+            fhTable[fh].open = 1;
+            fhTable[fh].position = 0;
+            fhTable[fh].raNext = -1;
+            fhTable[fh].raWindow = 0;
+            fhTable[fh].raDone = 0;
+        }
+        return( fh );
+    }
+
     //If file not in open file list
+    if((fh = new_File()) == -1){
+        return( -1 );
+    }
     file newFile; //Creates a new file
-    // Sets the name of the newly created file to be the 128 bit string at the path poiter
-    strncpy(newFile.name, path, 32*sizeof(int)); 
-
-    newFile.handle = fileHandleCounter; // Sets the value of the index in the fhHandle table
+    // Sets the name of the newly created file to be the string at the path poiter
+    strcpy(newFile.name, path);
 
-    //(Maybe for assignment 3)
-    fhTable = realloc(fhTable, (fileHandleCounter+1)*sizeof(file)); // allocates memory to be able to store a new file in the fh table
+    newFile.handle = fh; // Sets the value of the index in the fhHandle table
+    newFile.live = 1;
 
     //Sets the value of open in the new file to 1 and position and size to 0
     newFile.open = 1;
     newFile.position = 0;
     newFile.size = 0;
-
-    fhTable[fileHandleCounter] = newFile;
+    newFile.cacheHits = 0;
+    newFile.cacheMisses = 0;
+    newFile.bytesRead = 0;
+    newFile.bytesWritten = 0;
+    newFile.raNext = -1;
+    newFile.raWindow = 0;
+    newFile.raDone = 0;
+    newFile.prefetched = 0;
+    newFile.extents = NULL;
+    newFile.extentCount = 0;
+    newFile.extentCap = 0;
+    newFile.blockCount = 0;
+    newFile.written = 0;
+
+    fhTable[fh] = newFile;
+    if(index_File(fh)){
+        fhTable[fh].live = 0;
+        fhTable[fh].open = 0;
+        fhTable[fh].nameNext = fileFree;
+        fileFree = fh;
+        return( -1 );
+    }
     
     //logMessage( LOG_ERROR_LEVEL, "Did open work? fh = %s, fh = %d.", fhTable[newFile.handle].name, newFile.handle);
 
-    fileHandleCounter ++; // Increments the fileHandleCounter
-
     return( newFile.handle ); // Returns the file handle
 }
 
@@ -311,14 +1535,12 @@ LcFHandle lcopen( const char *path ) {
 int lcread( LcFHandle fh, char *buf, size_t len ) {
 
     int bytesRead = 0; // Variable to track the number of bytes read
-    char buf_256[256]; //256 byte buffer to be used for receiving data from the io bus
     int i = fhTable[fh].position/256; // Counter used to loop through the blocks, starts at the first block of the position
-    LCloudRegisterFrame instructionFrame; // Register frame to be used to pack instructions into
-    LCloudRegisterFrame resultFrame; // Register frame to be used to store the result of the io bus call
     int sector; // Sector value to be used in the io bus call
     int block; // Block number to be used in the io bus call
     int dev_Num; // Device number to be used in the io bus call
-    char *cacheCheck; // Buffer used to access the cache
+    int hit; // Whether the last block came out of the cache
+    struct block loc; // Where the current block is stored
 
     // Checks if the file is open
     if(fhTable[fh].open == 0){
@@ -326,39 +1548,32 @@ int lcread( LcFHandle fh, char *buf, size_t len ) {
                 return( -1 );   
     }
 
-    // Creates int variables for each of the register components to be used for error checking when extracting the result register
-    uint64_t b0, b1, c0, c1, c2, d0, d1; 
+    // Nothing past the end of the file is read
+    if(fhTable[fh].position >= fhTable[fh].size){
+        return( 0 );
+    }
+    if(len > (size_t)(fhTable[fh].size - fhTable[fh].position)){
+        len = fhTable[fh].size - fhTable[fh].position;
+    }
+
+    // Pull the rest of a sequential scan into the cache before copying it out
+    if(read_Ahead(fh, len)){
+        return( -1 );
+    }
 
-    while((len > 0) && fhTable[fh].blocks[i].blockNum != -1){ // Only executes if we read a length greater than 0 and there is file content still to be read
+    while((len > 0) && (loc = file_Block(&fhTable[fh], i)).blockNum != -1){ // Only executes if we read a length greater than 0 and there is file content still to be read
         
         if(fhTable[fh].position%256 != 0 && ((fhTable[fh].position%256 + len) > 256)){ // Preliminary case to make the reading done on block boundaries
-            sector = fhTable[fh].blocks[i].sector; // Determine the sector from the current block counter 
-            block = fhTable[fh].blocks[i].blockNum; // Determine the block from the current block counter
-            dev_Num = fhTable[fh].blocks[i].device; // Determine the device from the current block counter
-
-            cacheCheck = lcloud_getcache(dev_Num, sector, block);
-
-            if(cacheCheck != NULL){ // Check if the desired block is in the cache
-                memcpy(buf_256, cacheCheck, 256); // Copy over the cache data into the buf_256 value
-            } else {
-                instructionFrame = create_lcloud_registers(0, 0, LC_BLOCK_XFER, dev_Num, LC_XFER_READ, block, sector); //Pack the instruction frame
-
-                resultFrame = client_lcloud_bus_request(instructionFrame, buf_256); // Call the io bus with the instruction and save the result in the result frame
+            sector = loc.sector; // Determine the sector from the current block counter 
+            block = loc.blockNum; // Determine the block from the current block counter
+            dev_Num = loc.device; // Determine the device from the current block counter
 
-                // Checks to make sure that the operation was successful
-                if ( (instructionFrame == -1) || (resultFrame == -1) ||
-                    (extract_lcloud_registers(resultFrame, &b0, &b1, &c0, &c1, &c2, &d0, &d1)) ||
-                    (b0 != 1) || (b1 != 1) || (c0 != LC_BLOCK_XFER) ) {
-                    logMessage( LOG_ERROR_LEVEL, "Failure to read an entire block.");
-                    return( -1 );
-                    }
-
-                // In the case that it is not in the cache, we need to put it into the cache
-                lcloud_putcache(dev_Num, sector, block, buf_256); 
-            
+            // Copy the rest of the block from the cache, or from the device if it is not cached
+            if((hit = read_Block(dev_Num, sector, block, &buf[bytesRead], fhTable[fh].position%256, 256 - fhTable[fh].position%256)) == -1){
+                return( -1 );
             }
-
-            memcpy(&buf[bytesRead], &buf_256[fhTable[fh].position%256], 256 - fhTable[fh].position%256); // Copy over the bytes from the io call into the passed buffer from the function call
+            fhTable[fh].cacheHits += hit;
+            fhTable[fh].cacheMisses += !hit;
 
             bytesRead += 256 - fhTable[fh].position%256; // Increase the bytes read by 256 minus the relative position 
             len -= 256 - fhTable[fh].position%256; // Decreases the length by 256 minus the relative position
@@ -369,34 +1584,17 @@ int lcread( LcFHandle fh, char *buf, size_t len ) {
 
         else if((int)(len/256) > 0){ // Case where the next block we read is the entire block
             
-            sector = fhTable[fh].blocks[i].sector; // Determine the sector from the current block counter 
-            block = fhTable[fh].blocks[i].blockNum; // Determine the block from the current block counter
-            dev_Num = fhTable[fh].blocks[i].device; // Determine the device from the current block counter
+            sector = loc.sector; // Determine the sector from the current block counter 
+            block = loc.blockNum; // Determine the block from the current block counter
+            dev_Num = loc.device; // Determine the device from the current block counter
 
 
-            cacheCheck = lcloud_getcache(dev_Num, sector, block);
-
-            if(cacheCheck != NULL){ // Check if the desired block is in the cache
-                memcpy(buf_256, cacheCheck, 256); // Copy over the cache data into the buf_256 value
-            } else {
-                instructionFrame = create_lcloud_registers(0, 0, LC_BLOCK_XFER, dev_Num, LC_XFER_READ, block, sector); //Pack the instruction frame
-
-                resultFrame = client_lcloud_bus_request(instructionFrame, buf_256); // Call the io bus with the instruction and save the result in the result frame
-
-                // Checks to make sure that the operation was successful
-                if ( (instructionFrame == -1) || (resultFrame == -1) ||
-                    (extract_lcloud_registers(resultFrame, &b0, &b1, &c0, &c1, &c2, &d0, &d1)) ||
-                    (b0 != 1) || (b1 != 1) || (c0 != LC_BLOCK_XFER) ) {
-                    logMessage( LOG_ERROR_LEVEL, "Failure to read an entire block.");
-                    return( -1 );
-                    }
-
-                // In the case that it is not in the cache, we need to put it into the cache
-                lcloud_putcache(dev_Num, sector, block, buf_256); 
-            
+            // Copy the whole block from the cache, or from the device if it is not cached
+            if((hit = read_Block(dev_Num, sector, block, &buf[bytesRead], 0, 256)) == -1){
+                return( -1 );
             }
-
-            memcpy(&buf[bytesRead], buf_256, 256); // Copy over the bytes from the io call into the passed buffer from the function call
+            fhTable[fh].cacheHits += hit;
+            fhTable[fh].cacheMisses += !hit;
 
             bytesRead += 256; // Increase the bytes read by 256 
             len -= 256; // Decreases the length by 256 
@@ -404,58 +1602,34 @@ int lcread( LcFHandle fh, char *buf, size_t len ) {
             fhTable[fh].position += 256; // Move the position to the end of the read
 
         } //Maybe include the case of reading over 4096 bytes here 
-        else if (len > 256 && fhTable[fh].blocks[i+1].blockNum == -1) { // Case where we read over the length of the file
+        else if (len > 256 && i + 1 >= fhTable[fh].blockCount) { // Case where we read over the length of the file
 
-            sector = fhTable[fh].blocks[i].sector; // Determine the sector from the current block counter 
-            block = fhTable[fh].blocks[i].blockNum; // Determine the block from the current block counter
-            dev_Num = fhTable[fh].blocks[i].device; // Determine the device from the current block counter
+            sector = loc.sector; // Determine the sector from the current block counter 
+            block = loc.blockNum; // Determine the block from the current block counter
+            dev_Num = loc.device; // Determine the device from the current block counter
 
-            instructionFrame = create_lcloud_registers(0, 0, LC_BLOCK_XFER, dev_Num, LC_XFER_READ, block, sector); //Pack the instruction frame
-
-            resultFrame = client_lcloud_bus_request(instructionFrame, buf_256); // Call the io bus with the instruction and save the result in the result frame
-
-            // Checks to make sure that the operation was successful
-            if ( (instructionFrame == -1) || (resultFrame == -1) ||
-                (extract_lcloud_registers(resultFrame, &b0, &b1, &c0, &c1, &c2, &d0, &d1)) ||
-                (b0 != 1) || (b1 != 1) || (c0 != LC_BLOCK_XFER) ) {
-                logMessage( LOG_ERROR_LEVEL, "Failure to read when going over the max of the file");
+            // Copy the end of the file through the cache so unflushed writes are seen
+            if((hit = read_Block(dev_Num, sector, block, &buf[bytesRead], 0, fhTable[fh].size%256)) == -1){
                 return( -1 );
-                }
-
-            memcpy(&buf[bytesRead], buf_256, fhTable[fh].size%256); // Copy over the bytes from the io call into the passed buffer from the function call
+            }
+            fhTable[fh].cacheHits += hit;
+            fhTable[fh].cacheMisses += !hit;
 
             bytesRead += fhTable[fh].size%256; // Increase the bytes read by 256 
             fhTable[fh].position += fhTable[fh].size%256; // Move the position to the end of the read
             break; // break to stop the loop
         } else { // Case where the next block to be read is less than the entire block (We are reading the final block)
 
-            sector = fhTable[fh].blocks[i].sector; // Determine the sector from the current block counter 
-            block = fhTable[fh].blocks[i].blockNum; // Determine the block from the current block counter
-            dev_Num = fhTable[fh].blocks[i].device; // Determine the device from the current block counter
-
-            cacheCheck = lcloud_getcache(dev_Num, sector, block);
-
-            if(cacheCheck != NULL){ // Check if the desired block is in the cache
-                memcpy(buf_256, cacheCheck, 256); // Copy over the cache data into the buf_256 value
-            } else {
-                instructionFrame = create_lcloud_registers(0, 0, LC_BLOCK_XFER, dev_Num, LC_XFER_READ, block, sector); //Pack the instruction frame
-
-                resultFrame = client_lcloud_bus_request(instructionFrame, buf_256); // Call the io bus with the instruction and save the result in the result frame
-
-                // Checks to make sure that the operation was successful
-                if ( (instructionFrame == -1) || (resultFrame == -1) ||
-                    (extract_lcloud_registers(resultFrame, &b0, &b1, &c0, &c1, &c2, &d0, &d1)) ||
-                    (b0 != 1) || (b1 != 1) || (c0 != LC_BLOCK_XFER) ) {
-                    logMessage( LOG_ERROR_LEVEL, "Failure to read an entire block.");
-                    return( -1 );
-                    }
+            sector = loc.sector; // Determine the sector from the current block counter 
+            block = loc.blockNum; // Determine the block from the current block counter
+            dev_Num = loc.device; // Determine the device from the current block counter
 
-                // In the case that it is not in the cache, we need to put it into the cache
-                lcloud_putcache(dev_Num, sector, block, buf_256); 
-            
+            // Copy the last part of the read from the cache, or from the device if it is not cached
+            if((hit = read_Block(dev_Num, sector, block, &buf[bytesRead], fhTable[fh].position%256, len%256)) == -1){
+                return( -1 );
             }
-
-            memcpy(&buf[bytesRead], &buf_256[fhTable[fh].position%256], len%256); // Copy over the bytes from the io call into the passed buffer from the function call
+            fhTable[fh].cacheHits += hit;
+            fhTable[fh].cacheMisses += !hit;
 
             bytesRead += len%256; // Increase the blocks read by what is left of len
             fhTable[fh].position += len%256; // Move the position to the end of the read
@@ -464,6 +1638,7 @@ int lcread( LcFHandle fh, char *buf, size_t len ) {
             }
     }
 
+    fhTable[fh].bytesRead += bytesRead;
     return( bytesRead ); // Returns the number of bytes since the function was successful
 }
 
@@ -486,11 +1661,8 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
     block nextBlock;
     int bytesWrote = 0; // Variable to track the number of bytes read
     char buf_256[256]; //256 byte buffer to be used for receiving data from the io bus
-    LCloudRegisterFrame instructionFrame; // Register frame to be used to pack instructions into
-    LCloudRegisterFrame resultFrame; // Register frame to be used to store the result of the io bus call
     int sector; // Sector value to be used in the io bus call
     int currentBlock; // Block number to be used in the io bus call
-    int tempPosition; // Value to temporarily hold the position so it can be changed
     int dev_Num;
 
     // Checks if the file is open
@@ -499,27 +1671,18 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
                 return( -1 );   
     }
 
-    // Creates int variables for each of the register components to be used for error checking when extracting the result register
-    uint64_t b0, b1, c0, c1, c2, d0, d1; 
-
     while(len >= 256){
         //Case we are writing starting partway in a block
         if((fhTable[fh].position + bytesWrote)%256 != 0){
             
             // Gets the block we need to write into, the last block in the blocks list
-            nextBlock = fhTable[fh].blocks[(int)(fhTable[fh].position/256)];
+            nextBlock = file_Block(&fhTable[fh], (int)(fhTable[fh].position/256));
 
-            // Save the current position to be restored after
-            tempPosition = fhTable[fh].position;
-
-            // Change the position to the start of the block 
-            lcseek(fh, (fhTable[fh].position - fhTable[fh].position%256));
-
-            //Now we read the contents of that block and copy them into buf_256
-            lcread(fh, buf_256, 256);
-
-            // Restore the position from before copying over the block data
-            fhTable[fh].position = tempPosition;
+            // Read the whole block straight into buf_256, the bytes not written keep their contents
+            if(read_Block(nextBlock.device, nextBlock.sector, nextBlock.blockNum, buf_256, 0, 256) == -1){
+                logMessage( LOG_ERROR_LEVEL, "LC failure reading blkc [%d/%d/%d] to update it.", nextBlock.device, nextBlock.sector, nextBlock.blockNum );
+                return( -1 );
+            }
 
             // Set the block variables to be the location to be used
             currentBlock = nextBlock.blockNum;
@@ -529,18 +1692,12 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
             //Get the memory to write into the buffer to be used in the instruction from the passed argument buffer
             memcpy(&buf_256[fhTable[fh].position%256], &buf[bytesWrote], (256-fhTable[fh].position%256));
             
-            /* Do the write operation, check result (From PDM)*/
-            instructionFrame = create_lcloud_registers(0, 0, LC_BLOCK_XFER, dev_Num, LC_XFER_WRITE, currentBlock, sector );
-            if ( (instructionFrame == -1) || ((resultFrame = client_lcloud_bus_request(instructionFrame, buf_256)) == -1) ||
-            (extract_lcloud_registers(resultFrame, &b0, &b1, &c0, &c1, &c2, &d0, &d1)) ||
-            (b0 != 1) || (b1 != 1) || (c0 != LC_BLOCK_XFER) ) {
+            // Write the block to the device (or just the cache in write-back mode)
+            if(store_Block(dev_Num, sector, currentBlock, buf_256)){
                 logMessage( LOG_ERROR_LEVEL, "LC failure writing blkc [%d/%d/%d] (1).", dev_Num, sector, currentBlock );
                 return( -1 );
             }
 
-            // Update the cache
-            lcloud_putcache(dev_Num, sector, currentBlock, buf_256);
-
             // Update status variable to reflect a succesful write
             bytesWrote += (256-fhTable[fh].position%256);
             len -= (256-fhTable[fh].position%256);
@@ -556,11 +1713,11 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
 
             if((fhTable[fh].position + bytesWrote)>=fhTable[fh].size){
                 // Gets an unused block to be written into
-                nextBlock = get_Next_Block();
+                nextBlock = get_Next_Block(&fhTable[fh], (int)((fhTable[fh].position+bytesWrote)/256));
             }
             else{
                 // Gets the block at that position
-                nextBlock = fhTable[fh].blocks[(int)((fhTable[fh].position+bytesWrote)/256)];
+                nextBlock = file_Block(&fhTable[fh], (int)((fhTable[fh].position+bytesWrote)/256));
             }
             
 
@@ -579,26 +1736,21 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
             //Get the memory to write into the buffer to be used in the instruction from the passed argument buffer
             memcpy(buf_256, &buf[bytesWrote], 256);
             
-            /* Do the write operation, check result (From PDM)*/
-            instructionFrame = create_lcloud_registers(0, 0, LC_BLOCK_XFER, dev_Num, LC_XFER_WRITE, currentBlock, sector );
-            if ( (instructionFrame == -1) || ((resultFrame = client_lcloud_bus_request(instructionFrame, buf_256)) == -1) ||
-            (extract_lcloud_registers(resultFrame, &b0, &b1, &c0, &c1, &c2, &d0, &d1)) ||
-            (b0 != 1) || (b1 != 1) || (c0 != LC_BLOCK_XFER) ) {
-                logMessage( LOG_ERROR_LEVEL, "LC failure writing blkc [%d/%d/%d]. (2)", dev_Num, sector, currentBlock );
+            // Write the block to the device (or just the cache in write-back mode)
+            if(store_Block(dev_Num, sector, currentBlock, buf_256)){
+                logMessage( LOG_ERROR_LEVEL, "LC failure writing blkc [%d/%d/%d] (2).", dev_Num, sector, currentBlock );
                 return( -1 );
             }
 
-            // Update the cache
-            lcloud_putcache(dev_Num, sector, currentBlock, buf_256);
-
-            fhTable[fh].blocks[(int)((fhTable[fh].position+bytesWrote)/256)] = nextBlock; // Add the block to the list of blocks in the file
+            // Add the block to the list of blocks in the file
+            if(map_Block(&fhTable[fh], (int)((fhTable[fh].position+bytesWrote)/256), nextBlock)){
+                return( -1 );
+            }
 
             // Update status variable to reflect a succesful write
             bytesWrote += 256;
             len -= 256;
 
-            *(devOn[dev_Num].usedBlocks + sector*devOn[dev_Num].blocks + currentBlock) = 1; // Makes it so the block is counted as used
-            
             // If we increased the total size of the file, we have to update it
             if(fhTable[fh].size < fhTable[fh].position + bytesWrote){
 
@@ -614,11 +1766,11 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
             
             if((fhTable[fh].position + bytesWrote)>=fhTable[fh].size){
                 // Gets an unused block to be written into
-                nextBlock = get_Next_Block();
+                nextBlock = get_Next_Block(&fhTable[fh], (int)((fhTable[fh].position+bytesWrote)/256));
             }
             else{
                 // Gets the block at that position
-                nextBlock = fhTable[fh].blocks[(int)((fhTable[fh].position+bytesWrote)/256)];
+                nextBlock = file_Block(&fhTable[fh], (int)((fhTable[fh].position+bytesWrote)/256));
             }
 
             // Returns an error since there are no avaliable blocks
@@ -634,42 +1786,33 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
             if((fhTable[fh].position + bytesWrote)<fhTable[fh].size){
                 // Copy the contents of hte current block first
 
-                // Save the current position to be restored after
-                tempPosition = fhTable[fh].position;
-
-                // Change the position to the start of the block 
-                lcseek(fh, (fhTable[fh].position + bytesWrote));
-
-                //Now we read the contents of that block and copy them into buf_256
-                lcread(fh, buf_256, 256);
-
-                // Restore the position from before copying over the block data
-                fhTable[fh].position = tempPosition;
+                // Read the whole block straight into buf_256, the bytes not written keep their contents
+                if(read_Block(nextBlock.device, nextBlock.sector, nextBlock.blockNum, buf_256, 0, 256) == -1){
+                    logMessage( LOG_ERROR_LEVEL, "LC failure reading blkc [%d/%d/%d] to update it.", nextBlock.device, nextBlock.sector, nextBlock.blockNum );
+                    return( -1 );
+                }
+            } else {
+                memset(buf_256, 0, 256); // A new block past the end of the file starts out as zeros
             }
 
             //Get the memory to write into the buffer to be used in the instruction from the passed argument buffer
             memcpy(buf_256, &buf[bytesWrote], len);
             
-            /* Do the write operation, check result (From PDM)*/
-            instructionFrame = create_lcloud_registers(0, 0, LC_BLOCK_XFER, dev_Num, LC_XFER_WRITE, currentBlock, sector);
-            if ( (instructionFrame == -1) || ((resultFrame = client_lcloud_bus_request(instructionFrame, buf_256)) == -1) ||
-            (extract_lcloud_registers(resultFrame, &b0, &b1, &c0, &c1, &c2, &d0, &d1)) ||
-            (b0 != 1) || (b1 != 1) || (c0 != LC_BLOCK_XFER) ) {
-                logMessage( LOG_ERROR_LEVEL, "LC failure writing blkc [%d/%d/%d]. (3)", dev_Num, sector, currentBlock );
+            // Write the block to the device (or just the cache in write-back mode)
+            if(store_Block(dev_Num, sector, currentBlock, buf_256)){
+                logMessage( LOG_ERROR_LEVEL, "LC failure writing blkc [%d/%d/%d] (3).", dev_Num, sector, currentBlock );
                 return( -1 );
             }
 
-            // Update the cache
-            lcloud_putcache(dev_Num, sector, currentBlock, buf_256);
-
-            fhTable[fh].blocks[(int)((fhTable[fh].position+bytesWrote)/256)] = nextBlock; // Add the block to the list of blocks in the file
+            // Add the block to the list of blocks in the file
+            if(map_Block(&fhTable[fh], (int)((fhTable[fh].position+bytesWrote)/256), nextBlock)){
+                return( -1 );
+            }
 
             // Update status variable to reflect a succesful write
             bytesWrote += len;
             len -= len;
 
-            *(devOn[dev_Num].usedBlocks + sector*devOn[dev_Num].blocks + currentBlock) = 1; // Makes it so the block is counted as used
-            
             // If we increased the total size of the file, we have to update it
             if(fhTable[fh].size < fhTable[fh].position + bytesWrote){
 
@@ -681,19 +1824,13 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
             if(len > (256 - (fhTable[fh].position+bytesWrote)%256)){ // Case where we are going to need a new block
 
                 // Gets the block we need to write into, the last block in the blocks list
-                nextBlock = fhTable[fh].blocks[(int)((fhTable[fh].position + bytesWrote)/256)];
-
-                // Save the current position to be restored after
-                tempPosition = fhTable[fh].position;
-
-                // Change the position to the start of the block 
-                lcseek(fh, (fhTable[fh].position + bytesWrote - fhTable[fh].position%256));
+                nextBlock = file_Block(&fhTable[fh], (int)((fhTable[fh].position + bytesWrote)/256));
 
-                //Now we read the contents of that block and copy them into buf_256
-                lcread(fh, buf_256, 256);
-
-                // Restore the position from before copying over the block data
-                fhTable[fh].position = tempPosition;
+                // Read the whole block straight into buf_256, the bytes not written keep their contents
+                if(read_Block(nextBlock.device, nextBlock.sector, nextBlock.blockNum, buf_256, 0, 256) == -1){
+                    logMessage( LOG_ERROR_LEVEL, "LC failure reading blkc [%d/%d/%d] to update it.", nextBlock.device, nextBlock.sector, nextBlock.blockNum );
+                    return( -1 );
+                }
 
                 // Set the block variables to be the location to be used
                 currentBlock = nextBlock.blockNum;
@@ -703,18 +1840,12 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
                 //Get the memory to write into the buffer to be used in the instruction from the passed argument buffer
                 memcpy(&buf_256[fhTable[fh].position%256], &buf[bytesWrote], (256-fhTable[fh].position%256));
                 
-                /* Do the write operation, check result (From PDM)*/
-                instructionFrame = create_lcloud_registers(0, 0, LC_BLOCK_XFER, dev_Num, LC_XFER_WRITE, currentBlock, sector );
-                if ( (instructionFrame == -1) || ((resultFrame = client_lcloud_bus_request(instructionFrame, buf_256)) == -1) ||
-                (extract_lcloud_registers(resultFrame, &b0, &b1, &c0, &c1, &c2, &d0, &d1)) ||
-                (b0 != 1) || (b1 != 1) || (c0 != LC_BLOCK_XFER) ) {
-                    logMessage( LOG_ERROR_LEVEL, "LC failure writing blkc [%d/%d/%d]. (4)", dev_Num, sector, currentBlock );
+                // Write the block to the device (or just the cache in write-back mode)
+                if(store_Block(dev_Num, sector, currentBlock, buf_256)){
+                    logMessage( LOG_ERROR_LEVEL, "LC failure writing blkc [%d/%d/%d] (4).", dev_Num, sector, currentBlock );
                     return( -1 );
                 }
 
-                // Update the cache
-                lcloud_putcache(dev_Num, sector, currentBlock, buf_256);
-
                 // Update status variable to reflect a succesful write
                 bytesWrote += (256-fhTable[fh].position%256);
                 len -= (256-fhTable[fh].position%256);
@@ -729,11 +1860,11 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
 
                 if((fhTable[fh].position + bytesWrote)>=fhTable[fh].size){
                 // Gets an unused block to be written into
-                nextBlock = get_Next_Block();
+                nextBlock = get_Next_Block(&fhTable[fh], (int)((fhTable[fh].position+bytesWrote)/256));
                 }
                 else{
                     // Gets the block at that position
-                    nextBlock = fhTable[fh].blocks[(int)((fhTable[fh].position+bytesWrote)/256)];
+                    nextBlock = file_Block(&fhTable[fh], (int)((fhTable[fh].position+bytesWrote)/256));
                 }
 
                 // Returns an error since there are no avaliable blocks
@@ -749,43 +1880,33 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
                 if((fhTable[fh].position + bytesWrote)<fhTable[fh].size){
                     // Copy the contents of hte current block first
 
-                    // Save the current position to be restored after
-                    tempPosition = fhTable[fh].position;
-
-                    // Change the position to the start of the block 
-                    lcseek(fh, (fhTable[fh].position + bytesWrote));
-
-                    //Now we read the contents of that block and copy them into buf_256
-                    lcread(fh, buf_256, 256);
-
-                    // Restore the position from before copying over the block data
-                    fhTable[fh].position = tempPosition;
+                    // Read the whole block straight into buf_256, the bytes not written keep their contents
+                    if(read_Block(nextBlock.device, nextBlock.sector, nextBlock.blockNum, buf_256, 0, 256) == -1){
+                        logMessage( LOG_ERROR_LEVEL, "LC failure reading blkc [%d/%d/%d] to update it.", nextBlock.device, nextBlock.sector, nextBlock.blockNum );
+                        return( -1 );
+                    }
+                } else {
+                    memset(buf_256, 0, 256); // A new block past the end of the file starts out as zeros
                 }
 
                 //Get the memory to write into the buffer to be used in the instruction from the passed argument buffer
                 memcpy(buf_256, &buf[bytesWrote], len);
                 
-                /* Do the write operation, check result (From PDM)*/
-                instructionFrame = create_lcloud_registers(0, 0, LC_BLOCK_XFER, dev_Num, LC_XFER_WRITE, currentBlock, sector );
-                if ( (instructionFrame == -1) || ((resultFrame = client_lcloud_bus_request(instructionFrame, buf_256)) == -1) ||
-                (extract_lcloud_registers(resultFrame, &b0, &b1, &c0, &c1, &c2, &d0, &d1)) ||
-                (b0 != 1) || (b1 != 1) || (c0 != LC_BLOCK_XFER) ) {
-                    logMessage( LOG_ERROR_LEVEL, "LC failure writing blkc [%d/%d/%d]. (5)", dev_Num, sector, currentBlock );
+                // Write the block to the device (or just the cache in write-back mode)
+                if(store_Block(dev_Num, sector, currentBlock, buf_256)){
+                    logMessage( LOG_ERROR_LEVEL, "LC failure writing blkc [%d/%d/%d] (5).", dev_Num, sector, currentBlock );
                     return( -1 );
                 }
 
-                // Update the cache
-                lcloud_putcache(dev_Num, sector, currentBlock, buf_256);
-
-                fhTable[fh].blocks[(int)((fhTable[fh].position+bytesWrote)/256)] = nextBlock; // Add the block to the list of blocks in the file
+                // Add the block to the list of blocks in the file
+                if(map_Block(&fhTable[fh], (int)((fhTable[fh].position+bytesWrote)/256), nextBlock)){
+                    return( -1 );
+                }
 
                 // Update status variable to reflect a succesful write
                 bytesWrote += len;
                 len -= len;
 
-                // Makes it so the block is counted as used
-                *(devOn[dev_Num].usedBlocks + sector*devOn[dev_Num].blocks + currentBlock) = 1;
-                
                 // If we increased the total size of the file, we have to update it
                 if(fhTable[fh].size < fhTable[fh].position + bytesWrote){
 
@@ -795,19 +1916,13 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
 
             } else { // Case where we only need to finish writing in the current block
                 // Gets the block we need to write into, the last block in the blocks list
-                nextBlock = fhTable[fh].blocks[(int)(fhTable[fh].position/256)];
+                nextBlock = file_Block(&fhTable[fh], (int)(fhTable[fh].position/256));
 
-                // Save the current position to be restored after
-                tempPosition = fhTable[fh].position;
-
-                // Change the position to the start of the block 
-                lcseek(fh, (fhTable[fh].position - fhTable[fh].position%256));
-
-                //Now we read the contents of that block and copy them into buf_256
-                lcread(fh, buf_256, 256);
-
-                // Restore the position from before copying over the block data
-                fhTable[fh].position = tempPosition;
+                // Read the whole block straight into buf_256, the bytes not written keep their contents
+                if(read_Block(nextBlock.device, nextBlock.sector, nextBlock.blockNum, buf_256, 0, 256) == -1){
+                    logMessage( LOG_ERROR_LEVEL, "LC failure reading blkc [%d/%d/%d] to update it.", nextBlock.device, nextBlock.sector, nextBlock.blockNum );
+                    return( -1 );
+                }
 
                 // Set the block variables to be the location to be used
                 currentBlock = nextBlock.blockNum;
@@ -817,18 +1932,12 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
                 //Get the memory to write into the buffer to be used in the instruction from the passed argument buffer
                 memcpy(&buf_256[fhTable[fh].position%256], &buf[bytesWrote], len);
                 
-                /* Do the write operation, check result (From PDM)*/
-                instructionFrame = create_lcloud_registers(0, 0, LC_BLOCK_XFER, dev_Num, LC_XFER_WRITE, currentBlock, sector );
-                if ( (instructionFrame == -1) || ((resultFrame = client_lcloud_bus_request(instructionFrame, buf_256)) == -1) ||
-                (extract_lcloud_registers(resultFrame, &b0, &b1, &c0, &c1, &c2, &d0, &d1)) ||
-                (b0 != 1) || (b1 != 1) || (c0 != LC_BLOCK_XFER) ) {
-                    logMessage( LOG_ERROR_LEVEL, "LC failure writing blkc [%d/%d/%d]. (6)", dev_Num, sector, currentBlock );
+                // Write the block to the device (or just the cache in write-back mode)
+                if(store_Block(dev_Num, sector, currentBlock, buf_256)){
+                    logMessage( LOG_ERROR_LEVEL, "LC failure writing blkc [%d/%d/%d] (6).", dev_Num, sector, currentBlock );
                     return( -1 );
                 }
 
-                // Update the cache
-                lcloud_putcache(dev_Num, sector, currentBlock, buf_256);
-
                 // Update status variable to reflect a succesful write
                 bytesWrote += len;
                 len = 0;
@@ -845,6 +1954,12 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
 
     //Update the position by the number of bytes wrote
     fhTable[fh].position += bytesWrote;
+    fhTable[fh].bytesWritten += bytesWrote;
+
+    // Send the blocks of the write to the devices in one batch
+    if(flush_Writes()){
+        return( -1 );
+    }
 
     return( bytesWrote ); // Returns the number of bytes wrote because the test was successful
 }
@@ -895,10 +2010,191 @@ int lcclose( LcFHandle fh ) {
         return( -1 ); // Return -1 for an error since the file is not open or the file handle was invalid
     }
 
+    // Write back any of the file's blocks still queued or dirty in the cache
+    if(flush_Writes()){
+        logMessage( LOG_ERROR_LEVEL, "Failure flushing file [%s] on close.", fhTable[fh].name);
+        return( -1 );
+    }
+    if(lcloud_writebackcache() && fhTable[fh].blockCount > 0){
+        LcCacheKey *keys = malloc(fhTable[fh].blockCount*sizeof(LcCacheKey));
+        int n = 0;
+
+        if(keys == NULL){
+            logMessage( LOG_ERROR_LEVEL, "Failure flushing file [%s] on close.", fhTable[fh].name);
+            return( -1 );
+        }
+        for(int e = 0; e < fhTable[fh].extentCount; e++){
+            block loc = fhTable[fh].extents[e].start;
+            for(int i = 0; i < fhTable[fh].extents[e].length; i++, loc.blockNum++, n++){
+                keys[n].device = loc.device;
+                keys[n].sector = loc.sector;
+                keys[n].block = loc.blockNum;
+            }
+        }
+
+        // The dirty ones go out in batches
+        if(lcloud_flushblocks(keys, n)){
+            logMessage( LOG_ERROR_LEVEL, "Failure flushing file [%s] on close.", fhTable[fh].name);
+            free(keys);
+            return( -1 );
+        }
+        free(keys);
+    }
+
     // Changes the open variable in the file to be 0
     fhTable[fh].open = 0;
 
+    // A file that was never written holds nothing worth keeping, so its handle can be reused
+    if(!fhTable[fh].written){
+        release_File(fh);
+    }
+
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lctruncate
+// Description  : Shorten the file, the blocks past the new end are given back
+//                to the allocator with the next batch of released blocks and
+//                the rest of the new last block is zeroed
+//
+// Inputs       : fh - the file handle of the file to shorten
+//                len - the new length of the file
+// Outputs      : 0 if successful test, -1 if failure
+
+int lctruncate( LcFHandle fh, size_t len ) {
+
+    char buf_256[256]; // The new last block
+    block loc;
 
+    if(fh < 0 || fh >= fileHandleCounter || fhTable[fh].open == 0){
+        logMessage( LOG_ERROR_LEVEL, "The file handle was not valid or the file was not open.");
+        return( -1 );
+    }
+
+    // Files only get shorter, writes make them longer
+    if(fhTable[fh].size < len){
+        logMessage( LOG_ERROR_LEVEL, "The file is too short to be truncated to [%d].", (int)len);
+        return( -1 );
+    }
+
+    if(drop_Blocks(&fhTable[fh], (int)((len + 255)/256))){
+        return( -1 );
+    }
+
+    // Zero the part of the new last block past the end, so growing the file again never shows the old bytes
+    if(len%256 != 0){
+        loc = file_Block(&fhTable[fh], (int)(len/256));
+        if(read_Block(loc.device, loc.sector, loc.blockNum, buf_256, 0, 256) == -1){
+            return( -1 );
+        }
+        memset(&buf_256[len%256], 0, 256 - len%256);
+        if(store_Block(loc.device, loc.sector, loc.blockNum, buf_256) || flush_Writes()){
+            return( -1 );
+        }
+    }
+    fhTable[fh].size = len;
+    if(fhTable[fh].position > len){
+        fhTable[fh].position = len;
+    }
+
+    // The read ahead state may point at blocks that are gone
+    fhTable[fh].raNext = -1;
+    fhTable[fh].raWindow = 0;
+    fhTable[fh].raDone = 0;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcunlink
+// Description  : Delete a file that is not open, its blocks are given back to
+//                the allocator with the next batch of released blocks and its
+//                handle can be reused
+//
+// Inputs       : path - the path/filename of the file to delete
+// Outputs      : 0 if successful test, -1 if failure
+
+int lcunlink( const char *path ) {
+
+    LcFHandle fh = find_File(path);
+
+    if(fh == -1){
+        logMessage( LOG_ERROR_LEVEL, "There is no file [%s] to delete.", path);
+        return( -1 );
+    }
+    if(fhTable[fh].open){
+        logMessage( LOG_ERROR_LEVEL, "The file [%s] is open and cannot be deleted.", path);
+        return( -1 );
+    }
+
+    if(drop_Blocks(&fhTable[fh], 0)){
+        return( -1 );
+    }
+    release_File(fh);
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcstats
+// Description  : Take a snapshot of the cache and io bus statistics, cheap
+//                enough to be polled while the filesystem is in use
+//
+// Inputs       : stats - where to put the statistics
+// Outputs      : 0 if successful, -1 if failure
+
+int lcstats( LcStats *stats ) {
+
+    memset(stats, 0, sizeof(LcStats));
+    if(firstOpen){
+        return( 0 ); // Nothing has been started yet
+    }
+
+    if(lcloud_cachestats(&stats->cache) || client_lcloud_busstats(&stats->bus)){
+        return( -1 );
+    }
+
+    pthread_mutex_lock(&readsLock);
+    stats->readsCoalesced = readsCoalesced;
+    pthread_mutex_unlock(&readsLock);
+    stats->writesElided = writesElided;
+    stats->writesZeroed = writesZeroed;
+    stats->blocksFreed = blocksFreed;
+
+    // Count the files the filesystem knows about
+    stats->files = fileCount;
+    for(int i = 0; i < fileHandleCounter; i++){
+        stats->openFiles += fhTable[i].open;
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcfilestats
+// Description  : Take a snapshot of the statistics of a single file
+//
+// Inputs       : fh - the file handle of the file
+//                stats - where to put the statistics
+// Outputs      : 0 if successful, -1 if failure
+
+int lcfilestats( LcFHandle fh, LcFileStats *stats ) {
+
+    if(fh < 0 || fh >= fileHandleCounter || !fhTable[fh].live){
+        logMessage( LOG_ERROR_LEVEL, "The file handle was not valid.");
+        return( -1 );
+    }
+
+    stats->size = fhTable[fh].size;
+    stats->open = fhTable[fh].open;
+    stats->cacheHits = fhTable[fh].cacheHits;
+    stats->cacheMisses = fhTable[fh].cacheMisses;
+    stats->bytesRead = fhTable[fh].bytesRead;
+    stats->bytesWritten = fhTable[fh].bytesWritten;
+    stats->prefetched = fhTable[fh].prefetched;
+    stats->readahead = fhTable[fh].raWindow;
     return( 0 );
 }
 
@@ -916,15 +2212,31 @@ int lcshutdown( void ) {
     int i;
     for(i = 0; i<fileHandleCounter; i++){
         fhTable[i].open = 0;
-
+        free(fhTable[i].extents);
+        fhTable[i].extents = NULL;
     }
 
+    // Drop the queued writes and dirty copies of released blocks so the flush below skips them
+    reclaim_Blocks();
     for(i = 0; i<16; i++){
-        free(devOn[i].usedBlocks);
+        lcloud_alloc_close(&devOn[i].usedBlocks);
+        free(devOn[i].zeroBlocks);
+        devOn[i].zeroBlocks = NULL;
+    }
+
+    // Finish the reads ahead, then write back anything left queued or dirty in the cache before the devices go away
+    if(client_lcloud_bus_drain() || flush_Writes() || lcloud_flushcache()){
+        logMessage( LOG_ERROR_LEVEL, "LC failure flushing the cache on shutdown");
+        return( -1 );
     }
 
-    // Frees the table of all file handles
+    // Frees the table of all file handles and the name index
     free(fhTable);
+    free(nameIndex);
+    fhTable = NULL;
+    nameIndex = NULL;
+    fileHandleCounter = fileHandleCap = fileCount = 0;
+    fileFree = -1;
 
 
     // Packs the instruction for shutting down the device into the instruction LCloudRegisterFrame
@@ -14,14 +14,48 @@
 // Includes
 #include <stddef.h>
 #include <stdint.h>
+#include <lcloud_cache.h>
+#include <lcloud_client.h>
 
 // Defines 
+#define LC_READAHEAD_MIN 2 // Blocks read ahead once a file is being read sequentially
+#define LC_READAHEAD_MAX 16 // Largest read ahead window, in blocks
+#define LC_WRITE_QUEUE 64 // Most write-through blocks queued for one batch
+#define LC_FREE_QUEUE 256 // Most released blocks held before they are given back to the allocator together
+#define LC_MAX_PATH 128 // Longest file name, including the terminator
+#define LC_FILE_BUCKETS 64 // Starting number of buckets in the file name index
+#define LC_STRIPE_WIDTH 8 // Blocks of a file put on one device before moving to the next, 0 fills the devices in order
 
 // Type definitions
 typedef int32_t LcFHandle;
 
+typedef struct LcFileStats {
+    int size; // Size of the file in bytes
+    int open; // 1 if open, 0 if closed
+    long cacheHits; // Blocks read out of the cache
+    long cacheMisses; // Blocks read from the devices
+    long bytesRead; // Bytes returned by lcread
+    long bytesWritten; // Bytes accepted by lcwrite
+    long prefetched; // Blocks read ahead into the cache
+    int readahead; // Current read ahead window, in blocks
+} LcFileStats;
+
+typedef struct LcStats {
+    LcCacheStats cache; // Block cache counters
+    LcBusStats bus; // IO bus counters
+    int files; // Files the filesystem holds
+    int openFiles; // Files currently open
+    long readsCoalesced; // Block reads that waited on a read of the same block already in flight
+    long writesElided; // Block writes skipped because the cached copy already held the data
+    long writesZeroed; // All zero block writes kept only as metadata
+    long blocksFreed; // Blocks given back to the allocator by unlink and truncate
+} LcStats;
+
 // File system interface definitions
 
+LCloudRegisterFrame create_lcloud_registers(uint64_t b0, uint64_t b1, uint64_t c0, uint64_t c1, uint64_t c2, uint64_t d0, uint64_t d1);
+    // Pack the contents of a register
+
 int extract_lcloud_registers(uint64_t resp, uint64_t*b0, uint64_t*b1, uint64_t*c0, uint64_t*c1, uint64_t*c2, uint64_t*d0, uint64_t*d1);
     // Extract the contents of a register
 
@@ -40,6 +74,18 @@ int lcseek( LcFHandle fh, size_t off );
 int lcclose( LcFHandle fh );
     // Close the file
 
+int lctruncate( LcFHandle fh, size_t len );
+    // Shorten the file, releasing the blocks past the new end
+
+int lcunlink( const char *path );
+    // Delete a closed file, releasing its blocks
+
+int lcstats( LcStats *stats );
+    // Take a snapshot of the filesystem statistics
+
+int lcfilestats( LcFHandle fh, LcFileStats *stats );
+    // Take a snapshot of the statistics of a file
+
 int lcshutdown( void );
     // Shut down the filesystem
 